@@ -1,5 +1,6 @@
 #include "cache/cache.h"
 #include "tree/buffer_tree.h"
+#include "util/compress.h"
 
 #include <algorithm>
 #include <boost/bind.hpp>
@@ -8,24 +9,50 @@ using namespace yodb;
 
 Cache::Cache(const Options& opts)
     : options_(opts), cache_size_(0),
-      alive_(false), worker_(NULL)
+      cache_size_mutex_(), evict_cond_(cache_size_mutex_),
+      alive_(false), worker_(NULL), evictor_(NULL),
+      warmer_(NULL), warming_(false), secondary_(NULL),
+      table_(NULL), tree_(NULL),
+      loading_mutex_(), loading_cond_(loading_mutex_)
 {
 }
 
 Cache::~Cache()
 {
     alive_ = false;
+    warming_ = false;
+
+    if (warmer_) {
+        warmer_->join();
+        delete warmer_;
+    }
+
     if (worker_) {
         worker_->join();
         delete worker_;
         LOG_INFO << "Cache write back work thread finished.";
     }
 
+    if (evictor_) {
+        {
+            ScopedMutex lock(cache_size_mutex_);
+            evict_cond_.notify();
+        }
+        evictor_->join();
+        delete evictor_;
+        LOG_INFO << "Cache evictor thread finished.";
+    }
+
+    delete secondary_;
+
     LOG_INFO << "Cache destructor finished";
 }
 
 bool Cache::init()
 {
+    if (options_.secondary_cache_memory)
+        secondary_ = new SecondaryCache(options_.secondary_cache_memory);
+
     alive_ = true;
     worker_ = new Thread(boost::bind(&Cache::write_back, this));
 
@@ -35,6 +62,15 @@ bool Cache::init()
     }
 
     worker_->run();
+
+    evictor_ = new Thread(boost::bind(&Cache::evict_back, this));
+
+    if (evictor_ == NULL) {
+        LOG_ERROR << "create thread error";
+        return false;
+    }
+
+    evictor_->run();
     return true;
 }
 
@@ -52,8 +88,6 @@ void Cache::put(nid_t nid, Node* node)
 {
     assert(node->refs() == 0);
 
-    maybe_eviction(); 
-
     lock_nodes_.write_lock();
 
     assert(nodes_.find(nid) == nodes_.end());
@@ -61,56 +95,421 @@ void Cache::put(nid_t nid, Node* node)
     node->inc_ref();
 
     lock_nodes_.write_unlock();
+
+    {
+        ScopedMutex lock(cache_size_mutex_);
+        cache_size_ += node->size();
+    }
+    maybe_eviction(); 
+}
+
+Node* Cache::get(nid_t nid, bool partial)
+{
+    Node* node = lookup(nid);
+    if (node == NULL)
+        node = fetch(nid, partial);
+
+    // Read the rest of a node a lookup took partial.
+    if (node && !partial && !node->load_partitions()) {
+        node->dec_ref();
+        return NULL;
+    }
+
+    return node;
+}
+
+Node* Cache::fetch(nid_t nid, bool partial)
+{
+    Node* node;
+
+    {
+        ScopedMutex lock(loading_mutex_);
+
+        // Someone else is reading this node from disk,
+        // wait for it instead of issuing another read.
+        while (loading_.find(nid) != loading_.end())
+            loading_cond_.wait();
+
+        // The loader may finish before we got the mutex, check again.
+        node = lookup(nid);
+        if (node) return node;
+
+        if (retired_nids_.count(nid))
+            return NULL;
+
+        loading_.insert(nid);
+    }
+
+    node = load(nid, partial);
+
+    {
+        ScopedMutex lock(loading_mutex_);
+        loading_.erase(nid);
+        loading_cond_.notify_all();
+    }
+
+    return node;
 }
 
-Node* Cache::get(nid_t nid)
+Node* Cache::lookup(nid_t nid)
 {
+    Node* node = NULL;
+
     lock_nodes_.read_lock();
 
     NodeMap::iterator iter = nodes_.find(nid);
 
     if (iter != nodes_.end()) {
-        Node* node = iter->second;
+        node = iter->second;
         node->inc_ref();
-        lock_nodes_.read_unlock();
-        return node;
     }
 
     lock_nodes_.read_unlock();
 
-    maybe_eviction();
+    return node;
+}
+
+Node* Cache::load(nid_t nid, bool partial)
+{
+    Node* node;
+    Slice buffer;
+
+    // The node evicted lately may still be in the secondary cache.
+    // The entry is taken on every load, so none is left behind to go
+    // stale once the node is modified.
+    if (secondary_ && secondary_->take(nid, buffer)) {
+        Block block(buffer);
+        node = build(nid, &block);
+        buffer.release();
+        if (node) return node;
+    }
+
+    // A lookup only reads the header of a large node,
+    // and then the tables it needs.
+    const uint32_t kPartialReadSize = 32 << 10;
+    BlockHandle handle;
+
+    if (partial && table_->get_block_handle(nid, handle) && 
+        handle.size > kPartialReadSize) {
+        node = load_header(nid);
+        if (node) return node;
+    }
 
     Block* block = table_->read(nid);
     if (block == NULL) return NULL;
 
-    BlockReader reader(*block);
-    Node* node = tree_->create_node(nid);
+    node = build(nid, block);
 
-    assert(node->nid() == nid);
+    table_->self_dealloc(block->buffer());
+    delete block;
+
+    return node;
+}
 
-    if (!(node->constrcutor(reader))){
-        assert(false);
+Node* Cache::load_header(nid_t nid)
+{
+    const uint32_t kHeaderReadSize = 8 << 10;
+
+    Block* block = table_->read(nid, 0, kHeaderReadSize);
+    if (block == NULL) return NULL;
+
+    Node* node = NULL;
+    size_t header_size;
+
+    if (Node::partitioned(block->data(), block->size(), header_size)) {
+        // A large header takes another read.
+        if (header_size > block->size()) {
+            table_->self_dealloc(block->buffer());
+            delete block;
+            block = table_->read(nid, 0, header_size);
+        }
+
+        if (block) 
+            node = build_partitioned(nid, block, true);
     }
 
-    table_->self_dealloc(block->buffer());
+    if (block) {
+        table_->self_dealloc(block->buffer());
+        delete block;
+    }
 
-    lock_nodes_.write_lock();
+    return node;
+}
+
+Node* Cache::build_partitioned(nid_t nid, Block* block, bool partial)
+{
+    Node* node = tree_->create_node(nid);
 
-    if (nodes_.find(nid) != nodes_.end()) {
+    if (!node->decode(block->data(), block->size(), partial) || 
+        node->nid() != nid) {
+        LOG_ERROR << "bad node block, " << Fmt("nid=%zu", nid);
         delete node;
-        node = nodes_[nid];
+        return NULL;
+    }
+
+    return add(nid, node);
+}
+
+Node* Cache::build(nid_t nid, Block* block)
+{
+    CompressType type;
+    size_t size;
+
+    if (Node::partitioned(block->data(), block->size(), size))
+        return build_partitioned(nid, block, false);
+
+    if (!compress_header(block->data(), block->size(), type, size)) {
+        LOG_ERROR << "bad node header, " << Fmt("nid=%zu", nid);
+        return NULL;
+    }
+
+    // The node keeps the raw bytes as its backing, the Msg point into it.
+    // The read buffer is page rounded and recycled, so raw nodes are 
+    // copied once rather than held.
+    Slice raw = Slice::alloc(size ? size : 1);
+    Backing backing((char*)raw.data());
+
+    if (type != kNoCompress) {
+        if (!uncompress(block->data(), block->size(), (char*)raw.data())) {
+            LOG_ERROR << "uncompress node error, " << Fmt("nid=%zu", nid);
+            return NULL;
+        }
     } else {
-        nodes_[nid] = node;
+        memcpy((char*)raw.data(), block->data() + kCompressHeaderSize, size);
     }
+
+    Block input(raw, 0, size);
+
+    BlockReader reader(input);
+    Node* node = tree_->create_node(nid);
+
+    assert(node->nid() == nid);
+
+    bool succ = node->constrcutor(reader, backing);
+
+    if (!succ) {
+        LOG_ERROR << "bad node block, " << Fmt("nid=%zu", nid);
+        delete node;
+        return NULL;
+    }
+
+    return add(nid, node);
+}
+
+Node* Cache::add(nid_t nid, Node* node)
+{
+    lock_nodes_.write_lock();
+
+    assert(nodes_.find(nid) == nodes_.end());
+    nodes_[nid] = node;
     node->inc_ref();
 
     lock_nodes_.write_unlock();
 
+    {
+        ScopedMutex lock(cache_size_mutex_);
+        cache_size_ += node->size();
+    }
+    maybe_eviction();
+
     return node;
 }
 
+std::vector<nid_t> Cache::hot_nids()
+{
+    std::vector<NodeRank> nodes;
+    std::vector<nid_t> nids;
+
+    // Lookups still update the timestamps under the read lock, 
+    // so sort a copy of them.
+    lock_nodes_.read_lock();
+
+    for (NodeMap::iterator it = nodes_.begin(); it != nodes_.end(); it++)
+        nodes.push_back(NodeRank(it->second));
+
+    lock_nodes_.read_unlock();
+
+    std::sort(nodes.begin(), nodes.end());
+
+    for (size_t i = nodes.size(); i > 0; i--) 
+        nids.push_back(nodes[i - 1].nid);
+
+    return nids;
+}
+
+void Cache::warm_up()
+{
+    if (table_->get_hot_nids().empty()) 
+        return;
+
+    warming_ = true;
+    warmer_ = new Thread(boost::bind(&Cache::prefetch_hot_nodes, this));
+
+    if (warmer_ == NULL) {
+        LOG_ERROR << "create thread error";
+        return;
+    }
+
+    warmer_->run();
+}
+
+void Cache::prefetch_hot_nodes()
+{
+    const size_t kPrefetchBatch = 32;
+
+    std::vector<nid_t> hot = table_->get_hot_nids();
+
+    size_t headroom = options_.cache_limited_memory / 100 * 
+                      options_.cache_evict_headroom;
+    size_t budget = options_.cache_limited_memory - headroom;
+    size_t size;
+    {
+        ScopedMutex lock(cache_size_mutex_);
+        size = cache_size_;
+    }
+
+    // Choose the hottest nodes fit in the budget, 
+    // then read them in the order of file offset.
+    std::vector<std::pair<uint64_t, nid_t> > chosen;
+
+    for (size_t i = 0; i < hot.size(); i++) {
+        BlockHandle handle;
+
+        if (!table_->get_block_handle(hot[i], handle)) 
+            continue;
+        if (size + handle.size > budget) 
+            break;
+
+        size += handle.size;
+        chosen.push_back(std::make_pair(handle.offset, hot[i]));
+    }
+
+    std::sort(chosen.begin(), chosen.end());
+
+    size_t prefetched = 0;
+
+    for (size_t i = 0; i < chosen.size() && warming_; i += kPrefetchBatch) {
+        std::vector<nid_t> nids;
+
+        for (size_t j = i; j < chosen.size() && j < i + kPrefetchBatch; j++)
+            nids.push_back(chosen[j].second);
+
+        prefetched += prefetch(nids);
+
+        {
+            ScopedMutex lock(cache_size_mutex_);
+            if (need_eviction()) break;
+        }
+    }
+
+    LOG_INFO << "warm up finished, " << prefetched << " nodes prefetched";
+}
+
+size_t Cache::prefetch(const std::vector<nid_t>& candidates)
+{
+    std::vector<nid_t> nids;
+    std::vector<std::pair<nid_t, Slice> > parked;
+    size_t prefetched = 0;
+
+    // Skip the nodes already in memory or being loaded by others.
+    for (size_t i = 0; i < candidates.size(); i++) {
+        nid_t nid = candidates[i];
+        ScopedMutex lock(loading_mutex_);
+
+        if (loading_.find(nid) != loading_.end() || retired_nids_.count(nid))
+            continue;
+
+        Node* node = lookup(nid);
+        if (node) {
+            node->dec_ref();
+            continue;
+        }
+
+        loading_.insert(nid);
+
+        // A parked copy must not outlive the node we build, take it 
+        // rather than reading the disk.
+        Slice buffer;
+        if (secondary_ && secondary_->take(nid, buffer))
+            parked.push_back(std::make_pair(nid, buffer));
+        else
+            nids.push_back(nid);
+    }
+
+    for (size_t i = 0; i < parked.size(); i++) {
+        Block block(parked[i].second);
+        Node* node = build(parked[i].first, &block);
+        parked[i].second.release();
+
+        if (node) {
+            node->dec_ref();
+            prefetched++;
+        }
+
+        ScopedMutex lock(loading_mutex_);
+        loading_.erase(parked[i].first);
+        loading_cond_.notify_all();
+    }
+
+    if (nids.empty())
+        return prefetched;
+
+    PrefetchBatch batch;
+    batch.pending = nids.size();
+    batch.blocks.resize(nids.size(), NULL);
+
+    for (size_t i = 0; i < nids.size(); i++) {
+        table_->async_read(nids[i], boost::bind(
+            &Cache::prefetch_complete_handler, this, &batch, i, _1));
+    }
+
+    batch.mutex.lock();
+    while (batch.pending)
+        batch.cond.wait();
+    batch.mutex.unlock();
+
+    for (size_t i = 0; i < nids.size(); i++) {
+        if (batch.blocks[i]) {
+            Node* node = build(nids[i], batch.blocks[i]);
+            if (node) {
+                node->dec_ref();
+                prefetched++;
+            }
+
+            table_->self_dealloc(batch.blocks[i]->buffer());
+            delete batch.blocks[i];
+        }
+
+        ScopedMutex lock(loading_mutex_);
+        loading_.erase(nids[i]);
+        loading_cond_.notify_all();
+    }
+
+    return prefetched;
+}
+
+void Cache::prefetch_complete_handler(PrefetchBatch* batch, size_t i, Block* block)
+{
+    ScopedMutex lock(batch->mutex);
+
+    batch->blocks[i] = block;
+    batch->pending--;
+
+    if (batch->pending == 0)
+        batch->cond.notify();
+}
+
 void Cache::flush()
 {
+    // There is no need to warm up any more, we are shutting down.
+    warming_ = false;
+
+    if (warmer_) {
+        warmer_->join();
+        delete warmer_;
+        warmer_ = NULL;
+    }
+
     lock_nodes_.write_lock();
 
     std::vector<Node*> ready_nodes;
@@ -120,7 +519,7 @@ void Cache::flush()
         assert(node->refs() == 0);
 
         if (node->dirty() && !node->flushing()) {
-            node->write_lock();
+            node->read_lock();
             node->set_flushing(true);
             ready_nodes.push_back(node);
         }
@@ -131,6 +530,11 @@ void Cache::flush()
     if (ready_nodes.size())
         flush_ready_nodes(ready_nodes);
 
+    // Log the retired nids as removed with this checkpoint.
+    while (free_retired())
+        usleep(1000);
+
+    table_->set_hot_nids(hot_nids());
     table_->flush();
 }
 
@@ -185,7 +589,7 @@ void Cache::write_back()
         for (size_t i = 0; i < expired_nodes.size(); i++) {
             Node* node = expired_nodes[i];
 
-            if (node->try_write_lock()) {
+            if (node->try_read_lock()) {
                 node->set_flushing(true);
                 flush_size += node->size();
                 flush_nodes.push_back(node);
@@ -221,7 +625,7 @@ void Cache::write_back()
                 Node* node = maybe_nodes[i];
                 size_t size = node->size();
 
-                if (node->try_write_lock()) {
+                if (node->try_read_lock()) {
                     node->set_flushing(true);
                     flush_size += size;
                     flush_nodes.push_back(node);
@@ -236,41 +640,205 @@ void Cache::write_back()
         if (flush_nodes.size())
             flush_ready_nodes(flush_nodes);
 
+        free_retired();
+
         ::usleep(1000 * 100); // 100ms
     }
 }
 
+void Cache::retire(Node* node)
+{
+    // Nobody may read it back from now on, nor take a reference:
+    // the node is unreachable once it has none.
+    ScopedMutex lock_loading(loading_mutex_);
+    retired_nids_.insert(node->nid());
+
+    lock_nodes_.write_lock();
+
+    NodeMap::iterator iter = nodes_.find(node->nid());
+    assert(iter != nodes_.end() && iter->second == node);
+    nodes_.erase(iter);
+
+    lock_nodes_.write_unlock();
+
+    {
+        ScopedMutex lock(cache_size_mutex_);
+        cache_size_ -= std::min(cache_size_, node->size());
+    }
+
+    ScopedMutex lock(retired_mutex_);
+    retired_.push_back(node);
+}
+
+size_t Cache::free_retired()
+{
+    std::vector<Node*> nodes;
+    size_t left;
+
+    {
+        ScopedMutex lock(retired_mutex_);
+
+        std::vector<Node*> keep;
+
+        for (size_t i = 0; i < retired_.size(); i++) {
+            Node* node = retired_[i];
+
+            if (node->refs() == 0 && !node->flushing())
+                nodes.push_back(node);
+            else
+                keep.push_back(node);
+        }
+
+        retired_.swap(keep);
+        left = retired_.size();
+    }
+
+    for (size_t i = 0; i < nodes.size(); i++) {
+        Node* node = nodes[i];
+        nid_t nid = node->nid();
+
+        if (secondary_)
+            secondary_->erase(nid);
+
+        // The block is gone before the nid may be read again.
+        table_->free_nid(nid);
+        delete node;
+
+        ScopedMutex lock(loading_mutex_);
+        retired_nids_.erase(nid);
+    }
+
+    return left;
+}
+
 void Cache::flush_ready_nodes(std::vector<Node*>& ready_nodes)
 {
-    for (size_t i = 0; i < ready_nodes.size(); i++) {
-        Node* node = ready_nodes[i];
-        size_t bytes = node->write_back_size();
-        
-        Slice alloc_ptr = table_->self_alloc(bytes);
-        assert(alloc_ptr.size());
+    // Bound the memory of the serialized nodes waiting for a batch.
+    const size_t kMaxBatchBytes = 16 << 20;
 
-        Block block(alloc_ptr, 0, bytes);
-        BlockWriter writer(block);
+    // A table which keeps failing to serialize isn't just growing.
+    const int kMaxEncodeRetries = 100;
 
-        node->destructor(writer);
-        assert(writer.ok());
+    std::vector<nid_t> nids;
+    std::vector<Block*> blocks;
+    std::vector<Table::Callback> callbacks;
+    size_t batch_bytes = 0;
 
-        node->set_dirty(false);
-        node->write_unlock();
+    for (size_t i = 0; i < ready_nodes.size(); i++) {
+        Node* node = ready_nodes[i];
+
+        // The node is only read locked, writers could still insert 
+        // into its tables, so remember the version we serialize.
+        uint64_t version = node->version();
+        Slice alloc_ptr;
+        size_t bytes;
+
+        // Tables may grow after we got the size, try again then.
+        int retries = 0;
+        while ((alloc_ptr = encode(node, bytes)).size() == 0 && 
+               ++retries < kMaxEncodeRetries)
+            ;
+
+        // The node stays dirty, the next write back tries again.
+        if (alloc_ptr.size() == 0) {
+            LOG_ERROR << "encode node failed, " << Fmt("nid=%zu", node->nid());
+            node->read_unlock();
+            node->set_flushing(false);
+            continue;
+        }
 
-        table_->async_write(node->nid(), block,
-            boost::bind(&Cache::write_complete_handler, this, node, alloc_ptr, _1)); 
+        // Clean leaves are mostly read, pack them.
+        node->freeze();
+        node->read_unlock();
+        node->set_clean(version);
+
+        // The compressed node may need fewer pages than we allocated.
+        nids.push_back(node->nid());
+        blocks.push_back(new Block(Slice(alloc_ptr.data(), PAGE_ROUND_UP(bytes)), 0, bytes));
+        callbacks.push_back(boost::bind(&Cache::write_complete_handler, 
+                                        this, node, alloc_ptr, _1));
+        batch_bytes += bytes;
+
+        if (batch_bytes >= kMaxBatchBytes) {
+            write_batch(nids, blocks, callbacks);
+            batch_bytes = 0;
+        }
     }
 
+    if (nids.size())
+        write_batch(nids, blocks, callbacks);
+
     Timestamp now = Timestamp::now();
     double time = 30.0;
     if (time_interval(now, last_checkpoint_timestamp) > time) {
+        table_->set_hot_nids(hot_nids());
         table_->flush_immediately();
         table_->truncate();
         last_checkpoint_timestamp = now;
     }
 }
 
+void Cache::write_batch(std::vector<nid_t>& nids, std::vector<Block*>& blocks,
+                        std::vector<Table::Callback>& callbacks)
+{
+    table_->async_write_batch(nids, blocks, callbacks);
+
+    for (size_t i = 0; i < blocks.size(); i++)
+        delete blocks[i];
+
+    nids.clear();
+    blocks.clear();
+    callbacks.clear();
+}
+
+Slice Cache::encode(Node* node, size_t& bytes)
+{
+    if (options_.partitioned_nodes) {
+        Slice alloc_ptr = table_->self_alloc(node->encode_size());
+        assert(alloc_ptr.size());
+
+        bytes = node->encode(options_.compress, (char*)alloc_ptr.data(), 
+                             alloc_ptr.size());
+        if (bytes == 0) {
+            table_->self_dealloc(alloc_ptr);
+            return Slice();
+        }
+        return alloc_ptr;
+    }
+
+    size_t size = node->write_back_size();
+    Slice alloc_ptr = table_->self_alloc(max_compressed_size(size));
+    assert(alloc_ptr.size());
+
+    // Serialize the raw node just after the header, so it needs no copy
+    // if it is kept raw. Compression can't be done in place though.
+    Slice raw = alloc_ptr;
+    size_t offset = kCompressHeaderSize;
+
+    if (options_.compress != kNoCompress) {
+        raw = Slice::alloc(size);
+        offset = 0;
+    }
+
+    Block block(raw, offset, size);
+    BlockWriter writer(block);
+    bool succ = node->destructor(writer);
+
+    if (succ) 
+        bytes = compress(options_.compress, raw.data() + offset, size, 
+                         (char*)alloc_ptr.data());
+
+    if (options_.compress != kNoCompress) 
+        raw.release();
+
+    if (!succ) {
+        table_->self_dealloc(alloc_ptr);
+        return Slice();
+    }
+
+    return alloc_ptr;
+}
+
 void Cache::write_complete_handler(Node* node, Slice alloc_ptr, Status status)
 {
     assert(node != NULL);
@@ -286,22 +854,47 @@ void Cache::write_complete_handler(Node* node, Slice alloc_ptr, Status status)
 
 void Cache::maybe_eviction()
 {
-    {
-        ScopedMutex lock(cache_size_mutex_);
-        if (cache_size_ < options_.cache_limited_memory)
-            return;
+    ScopedMutex lock(cache_size_mutex_);
+
+    if (need_eviction())
+        evict_cond_.notify();
+}
+
+bool Cache::need_eviction()
+{
+    assert(cache_size_mutex_.is_locked_by_this_thread());
+
+    size_t headroom = options_.cache_limited_memory / 100 * 
+                      options_.cache_evict_headroom;
+
+    return cache_size_ + headroom > options_.cache_limited_memory;
+}
+
+void Cache::evict_back()
+{
+    while (alive_) {
+        {
+            ScopedMutex lock(cache_size_mutex_);
+            if (!need_eviction())
+                evict_cond_.wait_for_seconds(0.1); // 100ms
+        }
+
+        if (alive_)
+            evict_from_memory();
     }
-    evict_from_memory();
 }
 
 void Cache::evict_from_memory()
 {
-    // Apply write lock, don't allow any get/put operation,
-    // it is guaranteed no increase reference during this period.
-    lock_nodes_.write_lock(); 
-
     size_t total_size = 0;
-    std::vector<Node*> candidates;
+    size_t pinned_size = 0;
+    std::vector<NodeRank> candidates;
+
+    uint32_t height = tree_ ? tree_->height() : 0;
+
+    // Only the read lock is needed to choose candidates,
+    // foreground get() could go on during this period.
+    lock_nodes_.read_lock(); 
 
     for (NodeMap::iterator it = nodes_.begin(); it != nodes_.end(); it++) {
         Node* node = it->second;
@@ -310,45 +903,162 @@ void Cache::evict_from_memory()
         size_t size = node->size();
         total_size += size;
 
+        if (pinned(node, height))
+            pinned_size += size;
+
         if (node->refs() == 0 && !node->dirty() && !node->flushing())
-            candidates.push_back(node);
+            candidates.push_back(NodeRank(node));
     }
 
+    lock_nodes_.read_unlock();
+
+    size_t headroom = options_.cache_limited_memory / 100 * 
+                      options_.cache_evict_headroom;
+    size_t goal = 0;
+
+    if (total_size + headroom > options_.cache_limited_memory)
+        goal = total_size + headroom - options_.cache_limited_memory;
+
     {
         ScopedMutex lock(cache_size_mutex_);
         cache_size_ = total_size;
     }
 
+    if (goal == 0 || candidates.empty()) 
+        return;
+
+    // Leaves go first, upper levels are needed by every lookup below them.
+    std::sort(candidates.begin(), candidates.end());
+
     size_t evict_size = 0;
-    size_t goal = options_.cache_limited_memory / 100;
     std::vector<Node*> evict_nodes;
-    LRUComparator comparator;
-
+    std::vector<MsgTable*> evict_tables;
 
-    std::sort(candidates.begin(), candidates.end(), comparator);
+    // Apply write lock, don't allow any get/put operation,
+    // it is guaranteed no increase reference during this period.
+    // We only unlink the nodes here, they are freed by reclaim().
+    lock_nodes_.write_lock(); 
 
     for (size_t i = 0; i < candidates.size(); i++) {
-        Node* node = candidates[i];
+        Node* node = candidates[i].node;
+
+        // It may be retired and freed after we released the read lock,
+        // look it up before touching it.
+        NodeMap::iterator iter = nodes_.find(candidates[i].nid);
+        if (iter == nodes_.end() || iter->second != node)
+            continue;
+
+        // or things may change meanwhile
+        if (node->refs() || node->dirty() || node->flushing())
+            continue;
+
+        // An interior node gives up its cold tables first, its pivots stay
+        // so lookups still find their way down, and read only the table
+        // they need. Tables of the partitioned format can be read back.
+        if (node->height() > 0 && options_.partitioned_nodes) {
+            size_t usage = node->evict_tables(evict_tables);
+
+            if (usage) {
+                if (pinned(node, height))
+                    pinned_size -= std::min(pinned_size, usage);
+
+                evict_size += usage;
+                if (evict_size >= goal) break;
+                continue;
+            }
+        }
+
         size_t size = node->size();
 
-        assert(node->refs() == 0);
-        assert(!node->dirty());
-        assert(!node->flushing());
+        if (pinned(node, height)) {
+            if (pinned_size <= options_.cache_pinned_memory)
+                continue;
+            pinned_size -= std::min(pinned_size, size);
+        }
 
         evict_size += size;
         nodes_.erase(node->nid());
-
-        delete node;
+        evict_nodes.push_back(node);
 
         if (evict_size >= goal) break;
     }
 
+    lock_nodes_.write_unlock();
+
     {
         ScopedMutex lock(cache_size_mutex_);
-        cache_size_ -= evict_size;
+        cache_size_ -= std::min(cache_size_, evict_size);
     }
 
-    lock_nodes_.write_unlock();
+    reclaim(evict_nodes);
+
+    for (size_t i = 0; i < evict_tables.size(); i++)
+        delete evict_tables[i];
 
     // LOG_INFO << Fmt("evict %zuK bytes from memory", evict_size / 1024);
 }
+
+bool Cache::pinned(Node* node, uint32_t height)
+{
+    return node->height() + options_.cache_pinned_levels > height;
+}
+
+void Cache::reclaim(std::vector<Node*>& nodes)
+{
+    for (size_t i = 0; i < nodes.size(); i++) {
+        Node* node = nodes[i];
+
+        assert(node->refs() == 0);
+        assert(!node->dirty());
+        assert(!node->flushing());
+
+        if (secondary_)
+            park(node);
+
+        delete node;
+    }
+    nodes.clear();
+}
+
+void Cache::park(Node* node)
+{
+    nid_t nid = node->nid();
+    size_t bytes;
+
+    // Only whole nodes, the tables read stay on disk anyway.
+    // An older copy parked before must go in any case.
+    if (node->partial()) {
+        secondary_->erase(nid);
+        return;
+    }
+
+    Slice alloc_ptr = encode(node, bytes);
+    if (alloc_ptr.size() == 0) {
+        secondary_->erase(nid);
+        return;
+    }
+
+    // Only keep the compressed bytes.
+    Slice buffer = Slice(alloc_ptr.data(), bytes).clone();
+    table_->self_dealloc(alloc_ptr);
+
+    // The node may be read from disk and even modified again after 
+    // we unlinked it, the serialized form is stale in that case.
+    ScopedMutex lock(loading_mutex_);
+
+    if (loading_.find(nid) != loading_.end()) {
+        secondary_->erase(nid);
+        buffer.release();
+        return;
+    }
+
+    Node* resident = lookup(nid);
+    if (resident) {
+        resident->dec_ref();
+        secondary_->erase(nid);
+        buffer.release();
+        return;
+    }
+
+    secondary_->put(nid, buffer);
+}
@@ -2,14 +2,17 @@
 #define _YODB_CACHE_H_
 
 #include "db/options.h"
+#include "cache/secondary_cache.h"
 #include "fs/table.h"
 #include "fs/file.h"
 #include "sys/thread.h"
 #include "sys/rwlock.h"
 #include "sys/mutex.h"
+#include "sys/condition.h"
 #include "tree/node.h"
 
 #include <map>
+#include <set>
 
 namespace yodb {
 
@@ -32,10 +35,29 @@ public:
     // All nodes are managed by our Cache System,
     // if the node is not in the cache, then we will
     // invoke Table::read() to get node buffer from disk.
-    Node* get(nid_t nid);
+    // Concurrent misses on the same nid share a single read.
+    // A lookup may take the node partial, see Node::partial(),
+    // the node is returned with all its tables otherwise.
+    Node* get(nid_t nid, bool partial = false);
+
+    // Returns the referenced node if it is in memory, otherwise NULL.
+    Node* lookup(nid_t nid);
 
     void flush();
 
+    // Prefetch the nodes which were in memory at the last checkpoint 
+    // in background, hottest first, until the cache budget is reached.
+    void warm_up();
+
+    // Read the nodes which are not in memory at the same time and put
+    // them into cache. Returns the number of nodes read.
+    size_t prefetch(const std::vector<nid_t>& nids);
+
+    // The node was merged away or is an old root, it is unlinked now
+    // and its nid is never read again, but stragglers may still hold
+    // it: it is freed with its nid by free_retired() once unreferenced.
+    void retire(Node* node);
+
     Timestamp last_checkpoint_timestamp;
 private:
     // There is a single thread to write the memory node 
@@ -43,18 +65,90 @@ private:
     void write_back();
     void write_complete_handler(Node* node, Slice buffer, Status status);
 
+
+    // Read the node from disk and put it into cache,
+    // the caller must have registered nid in loading_.
+    Node* load(nid_t nid, bool partial);
+
+    // The node isn't in memory, read it unless someone else is.
+    Node* fetch(nid_t nid, bool partial);
+
+    // Read only the header of a partitioned node, NULL if it can't 
+    // or the node is in the whole format.
+    Node* load_header(nid_t nid);
+
+    // Construct the node from block and put it into cache,
+    // block is released.
+    Node* build(nid_t nid, Block* block);
+    Node* build_partitioned(nid_t nid, Block* block, bool partial);
+
+    // Put the node read into cache.
+    Node* add(nid_t nid, Node* node);
+
+    // nids of nodes in memory, hottest first.
+    std::vector<nid_t> hot_nids();
+
+    struct PrefetchBatch {
+        PrefetchBatch() : mutex(), cond(mutex), pending(0) {}
+
+        Mutex mutex;
+        CondVar cond;
+        size_t pending;
+        std::vector<Block*> blocks;
+    };
+
+    void prefetch_hot_nodes();
+    void prefetch_complete_handler(PrefetchBatch* batch, size_t i, Block* block);
+
     void flush_ready_nodes(std::vector<Node*>& nodes);
 
+    // Write the serialized nodes at once, the vectors are cleared.
+    void write_batch(std::vector<nid_t>& nids, std::vector<Block*>& blocks,
+                     std::vector<Table::Callback>& callbacks);
+
+    // Serialize and compress the node into a self_alloc() buffer, bytes is
+    // the framed size. Returns an empty slice if the tables grew meanwhile.
+    Slice encode(Node* node, size_t& bytes);
+
+    // Foreground get/put never evict by themselves, they only wake up
+    // the evictor thread when the free headroom is running out.
     void maybe_eviction();
+    bool need_eviction();
+
+    // There is also a single thread to evict clean nodes from memory,
+    // it keeps cache_evict_headroom percent of the cache memory free.
+    void evict_back();
     void evict_from_memory();
 
+    // Whether the node is in the top cache_pinned_levels levels 
+    // of a tree with the given height.
+    bool pinned(Node* node, uint32_t height);
+
+    // Evicted nodes are unlinked from nodes_ under the write lock, but
+    // freed afterwards without any lock held. An unlinked node with no
+    // reference is unreachable: references are only taken under lock_nodes_.
+    void reclaim(std::vector<Node*>& nodes);
+
+    // Keep the serialized form of the clean node in secondary cache.
+    void park(Node* node);
+
+    // Free the retired nodes which are unreferenced and not being 
+    // written. Returns the number left.
+    size_t free_retired();
+
 private:
     Options options_;
     size_t cache_size_;
     Mutex cache_size_mutex_;
+    CondVar evict_cond_;
 
     bool alive_;
     Thread* worker_;
+    Thread* evictor_;
+    Thread* warmer_;
+    bool warming_;
+
+    SecondaryCache* secondary_;
 
     Table* table_;
     BufferTree* tree_;
@@ -62,6 +156,19 @@ private:
     typedef std::map<nid_t, Node*> NodeMap;
     NodeMap nodes_; 
     RWLock lock_nodes_;
+
+    std::vector<Node*> retired_;
+    Mutex retired_mutex_;
+
+    // nids being read from disk right now, loading_mutex_ is
+    // always acquired before lock_nodes_.
+    std::set<nid_t> loading_;
+
+    // nids of the retired nodes until they are freed, their blocks
+    // are stale, guarded by loading_mutex_.
+    std::set<nid_t> retired_nids_;
+    Mutex loading_mutex_;
+    CondVar loading_cond_;
 };
 
 class FirstWriteComparator {
@@ -80,6 +187,28 @@ public:
     }
 };
 
+// Eviction order of the nodes, lower levels first, then least recently
+// used first. It is copied while lock_nodes_ is held, the timestamps
+// must not change under std::sort.
+struct NodeRank {
+    explicit NodeRank(Node* n)
+        : height(n->height()), last_used(n->get_last_used_timestamp()), 
+          nid(n->nid()), node(n)
+    {
+    }
+
+    uint32_t height;
+    Timestamp last_used;
+    nid_t nid;
+    Node* node;
+};
+
+inline bool operator<(const NodeRank& x, const NodeRank& y)
+{
+    if (x.height != y.height) 
+        return x.height < y.height;
+    return x.last_used < y.last_used;
+}
 
 } // namespace yodb
 
@@ -0,0 +1,93 @@
+#include "cache/secondary_cache.h"
+
+using namespace yodb;
+
+SecondaryCache::SecondaryCache(size_t capacity)
+    : capacity_(capacity), size_(0)
+{
+}
+
+SecondaryCache::~SecondaryCache()
+{
+    ScopedMutex lock(mutex_);
+
+    for (EntryMap::iterator it = entries_.begin(); it != entries_.end(); it++)
+        it->second.buffer.release();
+
+    entries_.clear();
+    lru_.clear();
+}
+
+void SecondaryCache::put(nid_t nid, Slice buffer)
+{
+    ScopedMutex lock(mutex_);
+
+    // The older copy is stale whether or not the new one fits.
+    EntryMap::iterator iter = entries_.find(nid);
+
+    if (iter != entries_.end()) {
+        size_ -= iter->second.buffer.size();
+        iter->second.buffer.release();
+        lru_.erase(iter->second.lru);
+        entries_.erase(iter);
+    }
+
+    if (buffer.size() > capacity_) {
+        buffer.release();
+        return;
+    }
+
+    while (size_ + buffer.size() > capacity_)
+        drop_oldest();
+
+    Entry entry;
+    entry.buffer = buffer;
+    entry.lru = lru_.insert(lru_.end(), nid);
+
+    entries_[nid] = entry;
+    size_ += buffer.size();
+}
+
+bool SecondaryCache::take(nid_t nid, Slice& buffer)
+{
+    ScopedMutex lock(mutex_);
+
+    EntryMap::iterator iter = entries_.find(nid);
+    if (iter == entries_.end()) 
+        return false;
+
+    buffer = iter->second.buffer;
+    size_ -= buffer.size();
+    lru_.erase(iter->second.lru);
+    entries_.erase(iter);
+
+    return true;
+}
+
+void SecondaryCache::erase(nid_t nid)
+{
+    Slice buffer;
+
+    if (take(nid, buffer))
+        buffer.release();
+}
+
+size_t SecondaryCache::size()
+{
+    ScopedMutex lock(mutex_);
+    return size_;
+}
+
+void SecondaryCache::drop_oldest()
+{
+    assert(mutex_.is_locked_by_this_thread());
+    assert(!lru_.empty());
+
+    EntryMap::iterator iter = entries_.find(lru_.front());
+    assert(iter != entries_.end());
+
+    size_ -= iter->second.buffer.size();
+    iter->second.buffer.release();
+    entries_.erase(iter);
+    lru_.pop_front();
+}
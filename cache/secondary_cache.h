@@ -0,0 +1,55 @@
+#ifndef _YODB_SECONDARY_CACHE_H_
+#define _YODB_SECONDARY_CACHE_H_
+
+#include "sys/mutex.h"
+#include "tree/node.h"
+#include "util/slice.h"
+
+#include <map>
+#include <list>
+#include <boost/noncopyable.hpp>
+
+namespace yodb {
+
+// SecondaryCache keeps the serialized form of the clean nodes evicted 
+// from Cache, so the next miss could rebuild the node from memory 
+// instead of reading it from disk. It holds far more nodes than Cache 
+// does with the same memory, the least recently parked ones are 
+// dropped first when we run out of capacity.
+class SecondaryCache : boost::noncopyable {
+public:
+    SecondaryCache(size_t capacity);
+    ~SecondaryCache();
+
+    // Park the buffer allocated by Slice::alloc(), we own it from now on.
+    void put(nid_t nid, Slice buffer);
+
+    // Take the buffer out if we have it, the caller should release it.
+    bool take(nid_t nid, Slice& buffer);
+
+    void erase(nid_t nid);
+
+    size_t size();
+
+private:
+    void drop_oldest();
+
+    typedef std::list<nid_t> LRUList;
+
+    struct Entry {
+        Slice buffer;
+        LRUList::iterator lru;
+    };
+
+    typedef std::map<nid_t, Entry> EntryMap;
+
+    size_t capacity_;
+    size_t size_;
+    EntryMap entries_;
+    LRUList lru_;
+    Mutex mutex_;
+};
+
+} // namespace yodb
+
+#endif // _YODB_SECONDARY_CACHE_H_
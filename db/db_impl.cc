@@ -8,6 +8,7 @@ DBImpl::~DBImpl()
     delete cache_;
     delete table_;
     delete file_;
+    delete pool_;
 }
 
 bool DBImpl::init()
@@ -32,9 +33,14 @@ bool DBImpl::init()
             create = false;
     }
 
-    file_ = env->open_aio_file(name_);
+    file_ = env->open_aio_file(name_, opts_.aio_backend, 
+                               opts_.io_queue_depth, opts_.io_uring_sqpoll);
 
-    table_ = new Table(file_, size);
+    pool_ = new BufferPool(opts_.io_buffer_pool_memory, 
+                           opts_.io_buffer_hugepages, opts_.io_buffer_region);
+    pool_->init(file_);
+
+    table_ = new Table(file_, size, pool_);
     if (!table_->init(create)) {
         LOG_ERROR << "init table error";
         return false;
@@ -10,7 +10,7 @@ namespace yodb {
 class DBImpl : public DB {
 public:
     DBImpl(const std::string& name, const Options& opts)
-        : name_(name), opts_(opts), file_(NULL),
+        : name_(name), opts_(opts), file_(NULL), pool_(NULL),
           table_(NULL), cache_(NULL), tree_(NULL)
     {
     }
@@ -28,6 +28,7 @@ private:
     Options opts_;
 
     AIOFile* file_;
+    BufferPool* pool_;
     Table* table_;
     Cache* cache_;
     BufferTree* tree_;
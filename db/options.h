@@ -3,6 +3,7 @@
 
 #include "db/comparator.h"
 #include "fs/env.h"
+#include "util/compress.h"
 
 namespace yodb {
 
@@ -14,17 +15,84 @@ public:
         env = NULL;
         max_node_child_number = 16;
         max_node_msg_count    = 10240;
+        push_down_threads     = 0;
+        merge_interval        = 0;
+        interior_append_log   = false;
         cache_limited_memory  = 1 << 28;
         cache_dirty_node_expire = 1;
+        cache_evict_headroom  = 10;
+        cache_pinned_levels   = 2;
+        cache_pinned_memory   = 1 << 26;
+        secondary_cache_memory = 0;
+        compress = kNoCompress;
+        partitioned_nodes = false;
+        aio_backend = kLinuxAIO;
+        io_queue_depth = 256;
+        io_uring_sqpoll = false;
+        io_buffer_pool_memory = 1 << 26;
+        io_buffer_hugepages = false;
+        io_buffer_region = 0;
     }
     Comparator* comparator;
     Env* env;
 
     size_t max_node_child_number;
     size_t max_node_msg_count;
+
+    // Threads an interior node pushes down to several full children
+    // with, zero pushes down one child at a time on the writer's thread.
+    size_t push_down_threads;
+
+    // Seconds between two passes merging the underfull sibling nodes 
+    // left by deletes, zero disables merging.
+    size_t merge_interval;
+
+    // Interior buffers take single writes into an append log with a hash
+    // index, and sort it once when pushed down or written back, so a
+    // write at the root costs O(1) instead of a skiplist insert.
+    bool interior_append_log;
+
     size_t cache_limited_memory;
     size_t cache_dirty_node_expire;
 
+    // Percent of cache_limited_memory the background evictor
+    // tries to keep free, so foreground operations never evict.
+    size_t cache_evict_headroom;
+
+    // Nodes in the top cache_pinned_levels levels of the tree are kept
+    // in memory ahead of the lower levels, unless they use more than
+    // cache_pinned_memory bytes. Leaves are always the first to go.
+    size_t cache_pinned_levels;
+    size_t cache_pinned_memory;
+
+    // Memory used to keep the serialized form of evicted clean nodes,
+    // zero disables the secondary cache.
+    size_t secondary_cache_memory;
+
+    // Codec of the serialized nodes, both on disk and in the secondary 
+    // cache. Nodes which don't compress well are always kept raw.
+    CompressType compress;
+
+    // Nodes are written with each pivot's table framed on its own behind
+    // a header of the pivots, so a lookup in a large node reads the header
+    // and the one table it needs. Nodes of either format are read.
+    bool partitioned_nodes;
+
+    // Backend of the data file. io_uring falls back to Linux AIO if the 
+    // kernel doesn't support it, io_queue_depth is its ring size, and
+    // with io_uring_sqpoll a kernel thread polls the submission ring.
+    AIOBackend aio_backend;
+    size_t io_queue_depth;
+    bool io_uring_sqpoll;
+
+    // Idle i/o buffers kept for reuse, in bytes. With io_buffer_hugepages 
+    // large buffers are backed by huge pages. io_buffer_region bytes are 
+    // preallocated for i/o buffers and registered with io_uring as fixed
+    // buffers, zero disables it.
+    size_t io_buffer_pool_memory;
+    bool io_buffer_hugepages;
+    size_t io_buffer_region;
+
 };
 
 } // namespace yodb
@@ -0,0 +1,82 @@
+#include "fs/allocator.h"
+#include <assert.h>
+
+using namespace yodb;
+
+void ExtentAllocator::insert(uint64_t offset, uint64_t size)
+{
+    by_offset_[offset] = size;
+    by_size_.insert(std::make_pair(size, offset));
+    total_ += size;
+}
+
+void ExtentAllocator::erase(uint64_t offset, uint64_t size)
+{
+    by_offset_.erase(offset);
+    by_size_.erase(std::make_pair(size, offset));
+    total_ -= size;
+}
+
+bool ExtentAllocator::allocate(uint64_t size, uint64_t& offset)
+{
+    SizeIndex::iterator iter = by_size_.lower_bound(std::make_pair(size, 0));
+    if (iter == by_size_.end()) 
+        return false;
+
+    uint64_t extent_size = iter->first;
+    uint64_t extent_offset = iter->second;
+
+    erase(extent_offset, extent_size);
+
+    if (extent_size > size)
+        insert(extent_offset + size, extent_size - size);
+
+    offset = extent_offset;
+    return true;
+}
+
+void ExtentAllocator::free(uint64_t& offset, uint64_t& size)
+{
+    assert(size);
+
+    OffsetIndex::iterator next = by_offset_.lower_bound(offset);
+
+    if (next != by_offset_.begin()) {
+        OffsetIndex::iterator prev = next;
+        prev--;
+
+        assert(prev->first + prev->second <= offset);
+
+        if (prev->first + prev->second == offset) {
+            offset = prev->first;
+            size += prev->second;
+            erase(prev->first, prev->second);
+        }
+    }
+
+    if (next != by_offset_.end()) {
+        assert(offset + size <= next->first);
+
+        if (offset + size == next->first) {
+            size += next->second;
+            erase(next->first, next->second);
+        }
+    }
+
+    insert(offset, size);
+}
+
+bool ExtentAllocator::remove_last(uint64_t end, uint64_t& offset)
+{
+    if (by_offset_.empty())
+        return false;
+
+    OffsetIndex::reverse_iterator last = by_offset_.rbegin();
+
+    if (last->first + last->second != end)
+        return false;
+
+    offset = last->first;
+    erase(last->first, last->second);
+    return true;
+}
@@ -0,0 +1,46 @@
+#ifndef _YODB_ALLOCATOR_H_
+#define _YODB_ALLOCATOR_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+#include <set>
+#include <boost/noncopyable.hpp>
+
+namespace yodb {
+
+// Free extents of the file, indexed both by offset (to coalesce the 
+// neighbours on free) and by size (to find the best fit on allocate).
+// Both operations are O(log n), the caller should do the locking.
+class ExtentAllocator : boost::noncopyable {
+public:
+    ExtentAllocator() : total_(0) {}
+
+    // Take size bytes from the smallest extent that fits.
+    bool allocate(uint64_t size, uint64_t& offset);
+
+    // Return the extent, it is merged with the adjacent free extents.
+    // offset and size are updated to the merged extent.
+    void free(uint64_t& offset, uint64_t& size);
+
+    // Remove the extent which ends at end, if there is one.
+    bool remove_last(uint64_t end, uint64_t& offset);
+
+    size_t count() const { return by_offset_.size(); }
+    uint64_t total() const { return total_; }
+
+private:
+    void insert(uint64_t offset, uint64_t size);
+    void erase(uint64_t offset, uint64_t size);
+
+    typedef std::map<uint64_t, uint64_t> OffsetIndex;
+    typedef std::set<std::pair<uint64_t, uint64_t> > SizeIndex;
+
+    OffsetIndex by_offset_;     // offset -> size
+    SizeIndex by_size_;         // (size, offset)
+    uint64_t total_;
+};
+
+} // namespace yodb
+
+#endif // _YODB_ALLOCATOR_H_
@@ -0,0 +1,190 @@
+#include "fs/buffer_pool.h"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+using namespace yodb;
+
+namespace {
+
+const size_t kPageSize = 4096;
+const size_t kHugePageSize = 2 << 20;
+
+// mmap() huge pages if we can, or else ask for transparent huge pages.
+void* mmap_buffer(size_t size, bool hugepages)
+{
+    void* ptr = MAP_FAILED;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+    if (hugepages && size % kHugePageSize == 0)
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+
+    if (ptr == MAP_FAILED) {
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (ptr == MAP_FAILED)
+            return NULL;
+
+        if (hugepages)
+            madvise(ptr, size, MADV_HUGEPAGE);
+    }
+
+    return ptr;
+}
+
+} // namespace
+
+BufferPool::BufferPool(size_t cap, bool hugepages, size_t region_size)
+    : cap_(cap), hugepages_(hugepages),
+      region_(NULL), region_size_(region_size), region_used_(0)
+{
+}
+
+BufferPool::~BufferPool()
+{
+    for (BufferMap::iterator it = buffers_.begin(); it != buffers_.end(); it++)
+        free_buffer(it->first, it->second);
+
+    if (region_)
+        munmap(region_, region_size_);
+
+    LOG_INFO << "buffer pool, " << stats_.hits << " hits, "
+             << stats_.misses << " misses";
+}
+
+bool BufferPool::init(AIOFile* file)
+{
+    if (region_size_ == 0)
+        return true;
+
+    region_size_ = (region_size_ + kPageSize - 1) & ~(kPageSize - 1);
+    region_ = (char*)mmap_buffer(region_size_, hugepages_);
+
+    if (region_ == NULL) {
+        LOG_ERROR << "mmap buffer region error: " << strerror(errno);
+        region_size_ = 0;
+        return false;
+    }
+
+    // Not every backend takes fixed buffers, the region is still used.
+    std::vector<Slice> regions(1, Slice(region_, region_size_));
+    if (file && file->register_buffers(regions))
+        LOG_INFO << "buffer region registered, " << region_size_ / 1024 << "K";
+
+    return true;
+}
+
+size_t BufferPool::class_size(size_t size)
+{
+    size_t cls = kPageSize;
+
+    while (cls < size)
+        cls <<= 1;
+
+    return cls;
+}
+
+char* BufferPool::allocate(size_t size, Source& source)
+{
+    assert(mutex_.is_locked_by_this_thread());
+
+    if (region_ && region_used_ + size <= region_size_) {
+        char* ptr = region_ + region_used_;
+
+        region_used_ += size;
+        source = kRegion;
+        return ptr;
+    }
+
+    if (hugepages_ && size >= kHugePageSize) {
+        source = kMmap;
+        return (char*)mmap_buffer(size, true);
+    }
+
+    void* ptr = NULL;
+    if (posix_memalign(&ptr, kPageSize, size) != 0)
+        return NULL;
+
+    source = kHeap;
+    return (char*)ptr;
+}
+
+void BufferPool::free_buffer(char* ptr, const Buffer& buffer)
+{
+    switch (buffer.source) {
+    case kHeap:
+        free(ptr);
+        break;
+    case kMmap:
+        munmap(ptr, buffer.size);
+        break;
+    case kRegion:
+        break;
+    }
+}
+
+Slice BufferPool::alloc(size_t size)
+{
+    size_t aligned_size = (size + kPageSize - 1) & ~(kPageSize - 1);
+    size_t cls = class_size(aligned_size);
+
+    ScopedMutex lock(mutex_);
+
+    std::vector<char*>& list = free_[cls];
+
+    if (list.size()) {
+        char* ptr = list.back();
+        list.pop_back();
+
+        stats_.hits++;
+        stats_.idle -= cls;
+        stats_.busy += cls;
+        return Slice(ptr, aligned_size);
+    }
+
+    Buffer buffer;
+    buffer.size = cls;
+
+    char* ptr = allocate(cls, buffer.source);
+    if (ptr == NULL) {
+        LOG_ERROR << "alloc i/o buffer error: " << strerror(errno);
+        return Slice();
+    }
+
+    buffers_[ptr] = buffer;
+
+    stats_.misses++;
+    stats_.busy += cls;
+    return Slice(ptr, aligned_size);
+}
+
+void BufferPool::dealloc(Slice slice)
+{
+    if (slice.size() == 0)
+        return;
+
+    char* ptr = (char*)slice.data();
+
+    ScopedMutex lock(mutex_);
+
+    BufferMap::iterator it = buffers_.find(ptr);
+    assert(it != buffers_.end());
+
+    Buffer buffer = it->second;
+    stats_.busy -= buffer.size;
+
+    // Region buffers are free anyway, keep them all.
+    if (buffer.source != kRegion && stats_.idle + buffer.size > cap_) {
+        free_buffer(ptr, buffer);
+        buffers_.erase(it);
+        return;
+    }
+
+    free_[buffer.size].push_back(ptr);
+    stats_.idle += buffer.size;
+}
+
+BufferPool::Stats BufferPool::stats()
+{
+    ScopedMutex lock(mutex_);
+    return stats_;
+}
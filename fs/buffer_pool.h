@@ -0,0 +1,83 @@
+#ifndef _YODB_BUFFER_POOL_H_
+#define _YODB_BUFFER_POOL_H_
+
+#include "fs/file.h"
+#include "sys/mutex.h"
+#include "util/slice.h"
+
+#include <stdint.h>
+#include <map>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+namespace yodb {
+
+// Page aligned i/o buffers, recycled by size class: a class holds the
+// buffers of a power of two pages. Idle buffers are kept up to the cap,
+// the rest are freed. Large buffers may be backed by huge pages.
+//
+// A region may also be preallocated and registered with the file, the
+// buffers carved from it are never freed and always kept for reuse.
+class BufferPool : boost::noncopyable {
+public:
+    BufferPool(size_t cap, bool hugepages, size_t region_size);
+    ~BufferPool();
+
+    // Allocate the region and register it with the file.
+    bool init(AIOFile* file);
+
+    // Returns a buffer of PAGE_ROUND_UP(size) bytes, empty if out of memory.
+    Slice alloc(size_t size);
+
+    // The buffer must be the one returned by alloc().
+    void dealloc(Slice buffer);
+
+    struct Stats {
+        Stats() : hits(0), misses(0), idle(0), busy(0) {}
+
+        uint64_t hits;      // alloc() served by an idle buffer
+        uint64_t misses;    // alloc() that allocated a new buffer
+        size_t idle;        // bytes of the idle buffers
+        size_t busy;        // bytes of the buffers in use
+    };
+
+    Stats stats();
+
+private:
+    enum Source {
+        kHeap,          // posix_memalign()
+        kMmap,          // mmap(), maybe huge pages
+        kRegion,        // carved from the registered region
+    };
+
+    struct Buffer {
+        size_t size;    // capacity, the size of its class
+        Source source;
+    };
+
+    size_t class_size(size_t size);
+
+    char* allocate(size_t size, Source& source);
+    void free_buffer(char* ptr, const Buffer& buffer);
+
+    size_t cap_;
+    bool hugepages_;
+
+    char* region_;
+    size_t region_size_;
+    size_t region_used_;
+
+    typedef std::map<size_t, std::vector<char*> > FreeList;
+    FreeList free_;
+
+    // every buffer allocated, idle or not
+    typedef std::map<char*, Buffer> BufferMap;
+    BufferMap buffers_;
+
+    Stats stats_;
+    Mutex mutex_;
+};
+
+} // namespace yodb
+
+#endif // _YODB_BUFFER_POOL_H_
@@ -2,6 +2,7 @@
 #define _YODB_ENV_H_
 
 #include "fs/file.h"
+#include "fs/uring_file.h"
 #include <string>
 #include <sys/stat.h>
 #include <boost/noncopyable.hpp>
@@ -41,9 +42,25 @@ public:
         return (size_t)(st.st_size);
     }
 
-    AIOFile* open_aio_file(const std::string& filename)
+    // io_uring falls back to Linux AIO if the kernel doesn't support it.
+    AIOFile* open_aio_file(const std::string& filename, 
+                           AIOBackend backend = kLinuxAIO,
+                           unsigned queue_depth = 256,
+                           bool sqpoll = false)
     {
-        AIOFile* faio = new AIOFile(full_path(filename));
+        AIOFile* faio;
+
+        if (backend == kIOUring) {
+            faio = new URingFile(full_path(filename), queue_depth, sqpoll);
+
+            if (faio && faio->open())
+                return faio;
+
+            delete faio;
+            LOG_INFO << "io_uring unavailable, use Linux AIO";
+        }
+
+        faio = new LibAIOFile(full_path(filename));
 
         if (faio && faio->open())
             return faio;
@@ -1,43 +1,57 @@
 #include "fs/file.h"
 #include <fcntl.h>
+#include <linux/falloc.h>
+#include <algorithm>
 #include <boost/bind.hpp>
 
 using namespace yodb;
 
 AIOFile::AIOFile(const std::string& path)
-    : path_(path), fd_(-1), 
-      closed_(false), ioctx_(0), thread_(NULL)
+    : path_(path), fd_(-1), fallocate_supported_(true)
 {
 }
 
-AIOFile::~AIOFile()
-{
-    close();
-}
-
-bool AIOFile::open()
+bool AIOFile::open_file()
 {
     fd_ = ::open(path_.c_str(), O_RDWR | O_DIRECT | O_CREAT, 0644);
     if (fd_ == -1) {
         LOG_ERROR << "open file " << path_ << " error: " << strerror(errno);
         return false;
     }
+    return true;
+}
+
+LibAIOFile::LibAIOFile(const std::string& path)
+    : AIOFile(path), closed_(true), ioctx_(0), thread_(NULL)
+{
+}
+
+LibAIOFile::~LibAIOFile()
+{
+    close();
+}
+
+bool LibAIOFile::open()
+{
+    if (!open_file())
+        return false;
 
     int status = io_setup(MAX_AIO_EVENTS, &ioctx_);
     if (status < 0) {
-        LOG_ERROR << "io_setup error: " << strerror(status);
+        LOG_ERROR << "io_setup error: " << strerror(-status);
         ::close(fd_);
         return false;
     }
 
-    thread_ = new Thread(boost::bind(&AIOFile::handle_io_complete, this));
+    closed_ = false;
+    thread_ = new Thread(boost::bind(&LibAIOFile::handle_io_complete, this));
     assert(thread_);
     thread_->run();
 
     return true;
 }
 
-void AIOFile::close()
+void LibAIOFile::close()
 {
     if (closed_ == false) {
         closed_ = true;
@@ -46,7 +60,7 @@ void AIOFile::close()
         
         int status = io_destroy(ioctx_);
         if (status < 0)
-            LOG_ERROR << "io_destroy error: " << strerror(status);
+            LOG_ERROR << "io_destroy error: " << strerror(-status);
 
         ::close(fd_);
     }
@@ -58,6 +72,38 @@ void AIOFile::truncate(uint64_t offset)
         LOG_ERROR << "ftruncate error: " << strerror(errno);
 }
 
+bool AIOFile::allocate(uint64_t offset, uint64_t size)
+{
+    if (!fallocate_supported_) 
+        return false;
+
+    if (fallocate(fd_, FALLOC_FL_KEEP_SIZE, offset, size) < 0) {
+        if (errno == EOPNOTSUPP) 
+            fallocate_supported_ = false;
+        else
+            LOG_ERROR << "fallocate error: " << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+bool AIOFile::punch_hole(uint64_t offset, uint64_t size)
+{
+    if (!fallocate_supported_) 
+        return false;
+
+    int mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+
+    if (fallocate(fd_, mode, offset, size) < 0) {
+        if (errno == EOPNOTSUPP) 
+            fallocate_supported_ = false;
+        else
+            LOG_ERROR << "punch hole error: " << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
 Status AIOFile::read(uint64_t offset, Slice& buffer)
 {
     BIORequest* request = new BIORequest();
@@ -90,61 +136,137 @@ Status AIOFile::write(uint64_t offset, const Slice& buffer)
     return stat;
 }
 
-void AIOFile::async_read(uint64_t offset, Slice& buffer, Callback cb)
+void LibAIOFile::async_read(uint64_t offset, Slice& buffer, Callback cb)
 {
-    struct iocb iocb;
-    struct iocb* iocbs = &iocb;
-
     AIORequest* request = new AIOReadRequest();
     request->size = buffer.size();
     request->callback = cb;
 
-    io_prep_pread(&iocb, fd_, (void*)buffer.data(), buffer.size(), offset);
-    iocb.data = request;
-
-    int status;
-    do {
-        status = io_submit(ioctx_, 1, &iocbs);
+    io_prep_pread(&request->iocb, fd_, (void*)buffer.data(), buffer.size(), offset);
+    request->iocb.data = request;
 
-        if (-status == EAGAIN) {
-            usleep(1000);
-        } else if (status < 0) {
-            LOG_ERROR << "io_submit error: " << strerror(-status);
-            request->complete(status);
-            delete request;
-            break;
-        }
-    } while (status < 0);
+    std::vector<AIORequest*> requests(1, request);
+    submit(requests);
 }
 
-void AIOFile::async_write(uint64_t offset, const Slice& buffer, Callback cb)
+void LibAIOFile::async_write(uint64_t offset, const Slice& buffer, Callback cb)
 {
-    struct iocb iocb;
-    struct iocb* iocbs = &iocb;
-
     AIORequest* request = new AIOWriteRequest();
     request->size = buffer.size();
     request->callback = cb;
 
-    io_prep_pwrite(&iocb, fd_, (void*)buffer.data(), buffer.size(), offset);
-    iocb.data = request;
+    io_prep_pwrite(&request->iocb, fd_, (void*)buffer.data(), buffer.size(), offset);
+    request->iocb.data = request;
 
-    int status;
-    do {
-        status = io_submit(ioctx_, 1, &iocbs);
+    std::vector<AIORequest*> requests(1, request);
+    submit(requests);
+}
+
+void LibAIOFile::async_write_batch(const std::vector<Write>& writes)
+{
+    std::vector<AIORequest*> requests;
+
+    for (size_t i = 0; i < writes.size(); i++) {
+        const Write& write = writes[i];
+        AIORequest* request = new AIOWriteRequest();
+
+        request->size = 0;
+        request->callback = write.callback;
+
+        for (size_t j = 0; j < write.buffers.size(); j++) {
+            struct iovec iov;
+            iov.iov_base = (void*)write.buffers[j].data();
+            iov.iov_len = write.buffers[j].size();
+
+            request->iov.push_back(iov);
+            request->size += iov.iov_len;
+        }
+
+        assert(request->iov.size());
+        io_prep_pwritev(&request->iocb, fd_, &request->iov[0], 
+                        request->iov.size(), write.offset);
+        request->iocb.data = request;
+
+        requests.push_back(request);
+    }
+
+    submit(requests);
+}
+
+void LibAIOFile::submit(std::vector<AIORequest*>& requests)
+{
+    size_t done = 0;
+
+    {
+        ScopedMutex lock(pending_mutex_);
+
+        // Don't jump over the requests queued before.
+        if (!pending_.empty()) {
+            pending_.insert(pending_.end(), requests.begin(), requests.end());
+            return;
+        }
+    }
+
+    done = submit_requests(requests);
+
+    if (done < requests.size()) {
+        ScopedMutex lock(pending_mutex_);
+        pending_.insert(pending_.end(), requests.begin() + done, requests.end());
+    }
+}
+
+void LibAIOFile::submit_pending()
+{
+    std::vector<AIORequest*> requests;
+
+    {
+        ScopedMutex lock(pending_mutex_);
+
+        if (pending_.empty()) return;
+
+        requests.assign(pending_.begin(), pending_.end());
+        pending_.clear();
+    }
+
+    size_t done = submit_requests(requests);
+
+    if (done < requests.size()) {
+        ScopedMutex lock(pending_mutex_);
+        pending_.insert(pending_.begin(), requests.begin() + done, requests.end());
+    }
+}
+
+size_t LibAIOFile::submit_requests(std::vector<AIORequest*>& requests)
+{
+    size_t done = 0;
+
+    while (done < requests.size()) {
+        struct iocb* iocbs[MAX_AIO_EVENTS];
+        size_t n = std::min(requests.size() - done, (size_t)MAX_AIO_EVENTS);
+
+        for (size_t i = 0; i < n; i++)
+            iocbs[i] = &requests[done + i]->iocb;
+
+        int status = io_submit(ioctx_, n, iocbs);
 
         if (-status == EAGAIN) {
-            usleep(1000);
+            break;
         } else if (status < 0) {
+            // The first one is refused, fail it and go on with the others.
             LOG_ERROR << "io_submit error: " << strerror(-status);
+
+            AIORequest* request = requests[done++];
             request->complete(status);
             delete request;
-            break;
+        } else {
+            done += status;
         }
-    } while (status < 0);
+    }
+
+    return done;
 }
 
-void AIOFile::handle_io_complete()
+void LibAIOFile::handle_io_complete()
 {
     while (!closed_) {
         struct io_event events[MAX_AIO_EVENTS];
@@ -170,5 +292,8 @@ void AIOFile::handle_io_complete()
             req->complete(events[i].res);
             delete req;
         }
+
+        // There is room in the queue again.
+        submit_pending();
     } 
 }
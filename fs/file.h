@@ -8,6 +8,9 @@
 #include "util/logger.h"
 
 #include <libaio.h>
+#include <sys/uio.h>
+#include <deque>
+#include <vector>
 #include <boost/noncopyable.hpp>
 #include <boost/function.hpp>
 
@@ -48,6 +51,10 @@ public:
     size_t size;
     Callback callback;
 
+    // kept until the request completes, it may be queued for a while
+    struct iocb iocb;
+    std::vector<struct iovec> iov;
+
     virtual void complete(int result) = 0;
 
     virtual ~AIORequest() {}
@@ -95,28 +102,85 @@ public:
     }
 };
 
+enum AIOBackend {
+    kLinuxAIO = 0,
+    kIOUring  = 1,
+};
+
+// The data file, all the i/o is done with O_DIRECT.
 class AIOFile : boost::noncopyable {
 public:
     AIOFile(const std::string& path);
-    ~AIOFile();
+    virtual ~AIOFile() {}
+
+    virtual bool open() = 0;
+    virtual void close() = 0;
 
-    bool open();
-    void close();
     void truncate(uint64_t offset);
 
+    // Reserve disk space without changing the file size.
+    bool allocate(uint64_t offset, uint64_t size);
+
+    // Give the disk space back to the file system, the range reads as zero.
+    bool punch_hole(uint64_t offset, uint64_t size);
+
     Status read(uint64_t offset, Slice& buffer);
     Status write(uint64_t offset, const Slice& buffer);
     
     typedef AIORequest::Callback Callback;
 
+    virtual void async_read(uint64_t offset, Slice& buffer, Callback cb) = 0;
+    virtual void async_write(uint64_t offset, const Slice& buffer, Callback cb) = 0;
+
+    // A vectored write, the buffers are written one after another.
+    struct Write {
+        uint64_t offset;
+        std::vector<Slice> buffers;
+        Callback callback;
+    };
+
+    // Submit all the writes with as few system calls as possible.
+    virtual void async_write_batch(const std::vector<Write>& writes) = 0;
+
+    // Buffers inside the registered regions are not mapped by the kernel
+    // on every i/o, if the backend supports it. Call it before any i/o.
+    virtual bool register_buffers(const std::vector<Slice>& regions) { return false; }
+
+protected:
+    bool open_file();
+
+    std::string path_;
+    int fd_;
+    bool fallocate_supported_;
+};
+
+// Linux native AIO backend.
+class LibAIOFile : public AIOFile {
+public:
+    LibAIOFile(const std::string& path);
+    ~LibAIOFile();
+
+    bool open();
+    void close();
+
     void async_read(uint64_t offset, Slice& buffer, Callback cb);
     void async_write(uint64_t offset, const Slice& buffer, Callback cb);
+    void async_write_batch(const std::vector<Write>& writes);
 
 private:
     void handle_io_complete();
 
-    std::string path_;
-    int fd_;
+    // Requests the kernel can't take now (EAGAIN) are queued,
+    // and submitted again by the completion thread.
+    void submit(std::vector<AIORequest*>& requests);
+    void submit_pending();
+
+    // Returns the number of requests submitted or failed.
+    size_t submit_requests(std::vector<AIORequest*>& requests);
+
+    std::deque<AIORequest*> pending_;
+    Mutex pending_mutex_;
+
     bool closed_;
     io_context_t ioctx_;
     Thread* thread_;
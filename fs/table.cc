@@ -1,18 +1,32 @@
 #include "fs/table.h"
+#include "util/crc32c.h"
 #include <stdlib.h>
+#include <algorithm>
 #include <boost/bind.hpp>
 
 using namespace yodb;
 
-Table::Table(AIOFile* file, uint64_t file_size)
-    : file_(file), file_size_(file_size), offset_(0),
-      fly_readers_(0), fly_writers_(0)
+namespace {
+
+// The bootstrap starts with them. A file written before they were added
+// starts with a bool and is refused, as is one of another version.
+// Bump the version whenever the layout on disk changes.
+const uint32_t kTableMagic = 0x42444f59;     // "YODB"
+const uint32_t kTableVersion = 1;
+
+} // namespace
+
+Table::Table(AIOFile* file, uint64_t file_size, BufferPool* pool)
+    : file_(file), pool_(pool), file_size_(file_size), offset_(0), prealloc_end_(0),
+      delta_size_(0), hot_nids_changed_(false),
+      fly_readers_(0), fly_writers_(0), inited_(false)
 {
 }
 
 Table::~Table()
 {
-    if (!flush()) {
+    // A file we couldn't read, say of an older format, is left alone.
+    if (inited_ && !flush()) {
         LOG_ERROR << "flush error";
         assert(false);
     }
@@ -45,10 +59,16 @@ bool Table::init(bool create)
             if (!load_header()) return false;
         }
 
+        if (bootstrap_.hot.offset) {
+            if (!load_hot_nids()) return false;
+        }
+
         init_holes();
+        init_free_nids();
         LOG_INFO << block_entry_.size() << " blocks found";
     }   
     truncate();
+    inited_ = true;
     return true;
 }
 
@@ -71,6 +91,9 @@ bool Table::flush()
 
 bool Table::flush_immediately()
 {
+    // Checkpoints may come from both the cache and flush().
+    ScopedMutex checkpoint(checkpoint_mutex_);
+
     size_t fly_holes;
     {
         ScopedMutex lock(fly_hole_list_mutex_);
@@ -78,6 +101,7 @@ bool Table::flush_immediately()
     }
 
     if (!flush_header()) return false;
+    if (!flush_hot_nids()) return false;
     if (!flush_bootstrap()) return false;
 
     flush_fly_holes(fly_holes);
@@ -90,19 +114,32 @@ bool Table::flush_bootstrap()
     Slice alloc_ptr = self_alloc(BOOTSTRAP_SIZE);
     assert(alloc_ptr.size());
 
-    Block block(alloc_ptr, 0, BOOTSTRAP_SIZE); 
+    // The last 4 bytes keep the checksum of the rest of the page.
+    memset((char*)alloc_ptr.data(), 0, BOOTSTRAP_SIZE);
+
+    Block block(alloc_ptr, 0, BOOTSTRAP_SIZE - 4); 
     BlockWriter writer(block);
     
     bool maybe = bootstrap_.header.offset == 0 ? false : true;
-    writer << maybe;
+    writer << kTableMagic << kTableVersion << maybe;
     if (writer.ok() && maybe) {
         writer << bootstrap_.header.offset 
                << bootstrap_.header.size
-               << bootstrap_.root_nid;
+               << bootstrap_.header.crc
+               << bootstrap_.root_nid
+               << bootstrap_.hot.offset
+               << bootstrap_.hot.size
+               << bootstrap_.hot.crc
+               << bootstrap_.delta.offset
+               << bootstrap_.delta.size
+               << bootstrap_.delta.crc;
     }
 
     assert(writer.ok());
 
+    uint32_t crc = crc32c::value(alloc_ptr.data(), BOOTSTRAP_SIZE - 4);
+    memcpy((char*)alloc_ptr.data() + BOOTSTRAP_SIZE - 4, &crc, 4);
+
     if (!write_file(0, alloc_ptr)) {
         LOG_INFO << "flush_bootstrap error";
         return false;
@@ -128,15 +165,42 @@ bool Table::load_bootstrap()
         return false;
     }
 
-    Block block(alloc_ptr, 0, BOOTSTRAP_SIZE);
+    Block block(alloc_ptr, 0, BOOTSTRAP_SIZE - 4);
     BlockReader reader(block);
+    uint32_t magic = 0, version = 0;
+
+    // Tell an older file from a corrupt one.
+    reader >> magic >> version;
+    if (magic != kTableMagic || version != kTableVersion) {
+        LOG_ERROR << "unsupported format, " << Fmt("version=%u", 
+                     magic == kTableMagic ? version : 0);
+        self_dealloc(alloc_ptr);
+        return false;
+    }
+
+    uint32_t crc;
+    memcpy(&crc, alloc_ptr.data() + BOOTSTRAP_SIZE - 4, 4);
+
+    if (crc != crc32c::value(alloc_ptr.data(), BOOTSTRAP_SIZE - 4)) {
+        LOG_ERROR << "bootstrap checksum mismatch";
+        self_dealloc(alloc_ptr);
+        return false;
+    }
+
     bool maybe = false;
 
     reader >> maybe;
     if (reader.ok() && maybe) {
         reader >> bootstrap_.header.offset 
                >> bootstrap_.header.size
-               >> bootstrap_.root_nid; 
+               >> bootstrap_.header.crc
+               >> bootstrap_.root_nid
+               >> bootstrap_.hot.offset
+               >> bootstrap_.hot.size
+               >> bootstrap_.hot.crc
+               >> bootstrap_.delta.offset
+               >> bootstrap_.delta.size
+               >> bootstrap_.delta.crc;
     }
 
     if (!reader.ok()) 
@@ -153,35 +217,308 @@ bool Table::load_bootstrap()
 
 bool Table::flush_header()
 {
-    uint32_t header_size = block_header_size();
-    Slice alloc_ptr = self_alloc(header_size);
+    const size_t kMaxDeltas = 64;
+
+    // Rewrite the whole index once the log is long enough to slow 
+    // down loading, otherwise only the changed entries are appended.
+    bool full = bootstrap_.header.offset == 0 || 
+                deltas_.size() >= kMaxDeltas ||
+                delta_size_ > bootstrap_.header.size / 4;
+
+    return full ? flush_full_header() : flush_delta();
+}
+
+bool Table::flush_full_header()
+{
+    std::vector<std::pair<nid_t, BlockHandle> > entries;
+    std::set<nid_t> dirty;
+
+    // Only copy the entries under the lock, writers go on 
+    // while we serialize and write them.
+    {
+        ScopedMutex lock(block_entry_mutex_);
+
+        entries.reserve(block_entry_.size());
+        for (BlockEntry::iterator iter = block_entry_.begin(); 
+             iter != block_entry_.end(); iter++) {
+            entries.push_back(std::make_pair(iter->first, *iter->second));
+        }
+        dirty.swap(dirty_nids_);
+    }
+
+    uint32_t header_size = 4 + entries.size() * kBlockEntrySize;
+    BlockHandle handle;
+
+    if (!write_index(entries, NULL, header_size, handle)) {
+        ScopedMutex lock(block_entry_mutex_);
+        dirty_nids_.insert(dirty.begin(), dirty.end());
+        return false;
+    }
+
+    LOG_INFO << "flush_header success, " 
+             << Fmt("offset=%zu, ", handle.offset)
+             << Fmt("size=%zu", header_size);
+
+    if (bootstrap_.header.offset) {
+        add_fly_hole(bootstrap_.header.offset, 
+                     PAGE_ROUND_UP(bootstrap_.header.size));
+    }
+
+    // The log is included in the new header.
+    for (size_t i = 0; i < deltas_.size(); i++)
+        add_fly_hole(deltas_[i].offset, PAGE_ROUND_UP(deltas_[i].size));
+
+    deltas_.clear();
+    delta_size_ = 0;
 
+    bootstrap_.header = handle;
+    bootstrap_.delta = BlockHandle();
+
+    return true;
+}
+
+bool Table::flush_delta()
+{
+    std::vector<std::pair<nid_t, BlockHandle> > entries;
+    std::set<nid_t> dirty;
+
+    {
+        ScopedMutex lock(block_entry_mutex_);
+
+        if (dirty_nids_.empty()) 
+            return true;
+
+        dirty.swap(dirty_nids_);
+
+        // An entry which is gone is logged with offset 0.
+        for (std::set<nid_t>::iterator it = dirty.begin(); it != dirty.end(); it++) {
+            BlockEntry::iterator iter = block_entry_.find(*it);
+            BlockHandle handle;
+
+            if (iter != block_entry_.end())
+                handle = *iter->second;
+
+            entries.push_back(std::make_pair(*it, handle));
+        }
+    }
+
+    uint32_t delta_size = kBlockHandleSize + 4 + entries.size() * kBlockEntrySize;
+    BlockHandle handle;
+
+    if (!write_index(entries, &bootstrap_.delta, delta_size, handle)) {
+        ScopedMutex lock(block_entry_mutex_);
+        dirty_nids_.insert(dirty.begin(), dirty.end());
+        return false;
+    }
+
+    LOG_INFO << "flush_delta success, " 
+             << Fmt("offset=%zu, ", handle.offset)
+             << Fmt("count=%zu", entries.size());
+
+    deltas_.push_back(handle);
+    delta_size_ += delta_size;
+
+    bootstrap_.delta = handle;
+
+    return true;
+}
+
+bool Table::write_index(const std::vector<std::pair<nid_t, BlockHandle> >& entries,
+                        const BlockHandle* prev, uint32_t size, BlockHandle& handle)
+{
+    Slice alloc_ptr = self_alloc(size);
     assert(alloc_ptr.size());
 
-    Block block(alloc_ptr, 0, header_size);
+    Block block(alloc_ptr, 0, size);
     BlockWriter writer(block);
-   
+
+    // A delta links to the one written before it.
+    if (prev) 
+        writer << prev->offset << prev->size << prev->crc;
+
+    writer << (uint32_t)entries.size();
+    for (size_t i = 0; i < entries.size(); i++) {
+        const BlockHandle& h = entries[i].second;
+        writer << entries[i].first << h.offset << h.size << h.crc;
+    }
+
+    assert(writer.ok());
+
+    uint64_t offset = find_space(alloc_ptr.size());
+    Status stat = file_->write(offset, alloc_ptr);
+
+    if (!stat.succ) {
+        LOG_ERROR << "write file error";
+        add_hole(offset, alloc_ptr.size());
+        self_dealloc(alloc_ptr);
+        return false;
+    }
+
+    handle.offset = offset;
+    handle.size = size;
+    handle.crc = crc32c::value(alloc_ptr.data(), size);
+
+    self_dealloc(alloc_ptr);
+    return true;
+}
+
+bool Table::read_entries(BlockReader& reader)
+{
+    uint32_t count = 0;
+
+    reader >> count;
+    while (reader.ok() && count > 0) {
+        nid_t nid;
+        BlockHandle handle;
+
+        reader >> nid >> handle.offset >> handle.size >> handle.crc;
+
+        if (reader.ok()) {
+            BlockEntry::iterator iter = block_entry_.find(nid);
+
+            if (handle.offset == 0) {
+                if (iter != block_entry_.end()) {
+                    delete iter->second;
+                    block_entry_.erase(iter);
+                }
+            } else if (iter != block_entry_.end()) {
+                *iter->second = handle;
+            } else {
+                block_entry_[nid] = new BlockHandle(handle);
+            }
+        }
+        
+        count--;
+    }
+
+    return reader.ok();
+}
+
+bool Table::load_header()
+{
+    assert(bootstrap_.header.offset > 0); 
+
+    Block* block = read_block(&bootstrap_.header);
+    if (block == NULL) {
+        LOG_ERROR << "read_block failed";
+        return false;
+    }
+
+    BlockReader reader(*block);
+    bool succ;
     {
         ScopedMutex lock(block_entry_mutex_);
+        succ = read_entries(reader);
+    }
 
-        uint32_t blocks = block_entry_.size();
-        BlockEntry::iterator iter;
+    self_dealloc(block->buffer());
+    delete block;
 
-        writer << blocks;
-        for (iter = block_entry_.begin(); iter != block_entry_.end(); iter++) {
-            nid_t nid = iter->first;
-            BlockHandle* handle = iter->second;
-            
-            writer << nid << handle->offset << handle->size;
+    if (!succ) {
+        LOG_ERROR << "load_header error";
+        return false;
+    }
+
+    LOG_INFO << "load_header success";
+
+    return load_deltas();
+}
+
+bool Table::load_deltas()
+{
+    std::vector<Block*> blocks;
+    BlockHandle handle = bootstrap_.delta;
+    bool succ = true;
+
+    // Walk the log from the newest, then apply it from the oldest.
+    while (handle.offset) {
+        Block* block = read_block(&handle);
+        if (block == NULL) {
+            LOG_ERROR << "read_block failed";
+            succ = false;
+            break;
         }
 
-        if (!writer.ok()) {
-            LOG_ERROR << "flush_header error";
-            self_dealloc(alloc_ptr);
-            return false;
+        deltas_.push_back(handle);
+        delta_size_ += handle.size;
+        blocks.push_back(block);
+
+        BlockReader reader(*block);
+        handle = BlockHandle();
+        reader >> handle.offset >> handle.size >> handle.crc;
+
+        if (!reader.ok()) {
+            succ = false;
+            break;
         }
     }
 
+    std::reverse(deltas_.begin(), deltas_.end());
+
+    for (size_t i = blocks.size(); i > 0; i--) {
+        Block* block = blocks[i - 1];
+        BlockReader reader(*block);
+        BlockHandle prev;
+
+        reader >> prev.offset >> prev.size >> prev.crc;
+
+        if (succ) {
+            ScopedMutex lock(block_entry_mutex_);
+            succ = read_entries(reader);
+        }
+
+        self_dealloc(block->buffer());
+        delete block;
+    }
+
+    if (!succ)
+        LOG_ERROR << "load_deltas error";
+    else if (deltas_.size())
+        LOG_INFO << "load_deltas success, " << deltas_.size() << " deltas";
+
+    return succ;
+}
+
+void Table::set_hot_nids(const std::vector<nid_t>& nids)
+{
+    ScopedMutex lock(hot_nids_mutex_);
+
+    hot_nids_ = nids;
+    hot_nids_changed_ = true;
+}
+
+std::vector<nid_t> Table::get_hot_nids()
+{
+    ScopedMutex lock(hot_nids_mutex_);
+    return hot_nids_;
+}
+
+bool Table::flush_hot_nids()
+{
+    std::vector<nid_t> nids;
+    {
+        ScopedMutex lock(hot_nids_mutex_);
+
+        if (!hot_nids_changed_) return true;
+
+        nids = hot_nids_;
+        hot_nids_changed_ = false;
+    }
+
+    uint32_t size = 4 + nids.size() * sizeof(nid_t);
+    Slice alloc_ptr = self_alloc(size);
+
+    assert(alloc_ptr.size());
+
+    Block block(alloc_ptr, 0, size);
+    BlockWriter writer(block);
+
+    writer << (uint32_t)nids.size();
+    for (size_t i = 0; i < nids.size(); i++)
+        writer << nids[i];
+
+    assert(writer.ok());
+
     uint64_t offset = find_space(alloc_ptr.size());
     Status stat = file_->write(offset, alloc_ptr);
 
@@ -192,62 +529,58 @@ bool Table::flush_header()
         return false;
     }
 
-    LOG_INFO << "flush_header success, " 
-             << Fmt("offset=%zu, ", offset)
-             << Fmt("size=%zu", header_size);
-
-    if (bootstrap_.header.offset) {
-        add_fly_hole(bootstrap_.header.offset, 
-                     PAGE_ROUND_UP(bootstrap_.header.size));
+    if (bootstrap_.hot.offset) {
+        add_fly_hole(bootstrap_.hot.offset, 
+                     PAGE_ROUND_UP(bootstrap_.hot.size));
     }
 
-    bootstrap_.header.offset = offset;
-    bootstrap_.header.size = header_size;
+    bootstrap_.hot.offset = offset;
+    bootstrap_.hot.size = size;
+    bootstrap_.hot.crc = crc32c::value(alloc_ptr.data(), size);
 
     self_dealloc(alloc_ptr);
 
+    LOG_INFO << "flush_hot_nids success, " 
+             << Fmt("offset=%zu, ", offset)
+             << Fmt("count=%zu", nids.size());
     return true;
 }
 
-bool Table::load_header()
+bool Table::load_hot_nids()
 {
-    assert(bootstrap_.header.offset > 0); 
+    assert(bootstrap_.hot.offset > 0); 
 
-    Block* block = read_block(&bootstrap_.header);
+    Block* block = read_block(&bootstrap_.hot);
     if (block == NULL) {
         LOG_ERROR << "read_block failed";
         return false;
     }
 
     BlockReader reader(*block);
-    uint32_t blocks = 0;
-    ScopedMutex lock(block_entry_mutex_);
+    uint32_t count = 0;
+    ScopedMutex lock(hot_nids_mutex_);
 
-    reader >> blocks;
-    while (reader.ok() && blocks > 0) {
+    reader >> count;
+    while (reader.ok() && count > 0) {
         nid_t nid;
-        BlockHandle* handle = new BlockHandle();
-        assert(handle);
-
-        reader >> nid >> handle->offset >> handle->size;
 
+        reader >> nid;
         if (reader.ok())
-            block_entry_[nid] = handle;
-        else
-            delete handle;
-        
-        blocks--;
+            hot_nids_.push_back(nid);
+
+        count--;
     }
 
     if (!reader.ok())
-        LOG_ERROR << "load_header error";
+        LOG_ERROR << "load_hot_nids error";
     else 
-        LOG_INFO << "load_header success";
+        LOG_INFO << "load_hot_nids success, " << hot_nids_.size() << " nids";
 
     self_dealloc(block->buffer());
     delete block;
     return reader.ok();
 }
+
 void Table::flush_fly_holes(size_t fly_holes)
 {
     ScopedMutex lock(fly_hole_list_mutex_);
@@ -267,6 +600,12 @@ void Table::init_holes()
     std::map<uint64_t, BlockHandle*> offset_set; 
     offset_set[bootstrap_.header.offset] = &bootstrap_.header;
 
+    if (bootstrap_.hot.offset)
+        offset_set[bootstrap_.hot.offset] = &bootstrap_.hot;
+
+    for (size_t i = 0; i < deltas_.size(); i++)
+        offset_set[deltas_[i].offset] = &deltas_[i];
+
     BlockEntry::iterator iter;
     for (iter = block_entry_.begin(); iter != block_entry_.end(); iter++) {
         offset_set[iter->second->offset] = iter->second;
@@ -296,76 +635,84 @@ void Table::init_holes()
 
 void Table::add_hole(uint64_t offset, uint32_t size)
 {
+    // Punch only the holes larger than this, small ones are reused soon.
+    const uint64_t kPunchHoleSize = 1 << 20;
+
+    ScopedMutex lock(holes_mutex_);
+
+    uint64_t extent_offset = offset;
+    uint64_t extent_size = size;
+
+    holes_.free(extent_offset, extent_size);
+
     {
+        // The file shrinks if the hole is at the end.
         ScopedMutex lock(mutex_);
-        if (offset + size == offset_) {
-            offset_ = offset;
-            return ;
+
+        uint64_t last;
+        if (holes_.remove_last(offset_, last)) {
+            offset_ = last;
+            return;
         }
     }
 
-    Hole hole;
-    hole.size = size;
-    hole.offset = offset;
+    // Punch the whole extent once it gets large enough, the part freed 
+    // later is punched by itself. The lock is held, no one can reuse 
+    // the extent before it is punched.
+    if (extent_size >= kPunchHoleSize) {
+        if (extent_size - size < kPunchHoleSize)
+            file_->punch_hole(extent_offset, extent_size);
+        else
+            file_->punch_hole(offset, size);
+    }
+}
 
-    ScopedMutex lock(hole_list_mutex_);
+void Table::init_free_nids()
+{
+    ScopedMutex lock(block_entry_mutex_);
 
-    if (hole_list_.empty()) {
-        hole_list_.push_back(hole);
-        return;
+    nid_t nid = NID_NIL;
+    for (BlockEntry::iterator iter = block_entry_.begin(); 
+         iter != block_entry_.end(); iter++) {
+        while (++nid < iter->first)
+            free_nids_.push_back(nid);
     }
+}
 
-    HoleList::iterator iter, prev;
-    for (iter = hole_list_.begin(); iter != hole_list_.end(); iter++) {
-        if (iter->offset > hole.offset)
-            break;
-        prev = iter;
-    }
+void Table::free_nid(nid_t nid)
+{
+    ScopedMutex lock(block_entry_mutex_);
 
-    if (iter != hole_list_.end()) {
-        assert(hole.offset + hole.size <= iter->offset);
-        if (iter != hole_list_.begin()) {
-            assert(prev->offset + prev->size <= hole.offset);
+    BlockEntry::iterator iter = block_entry_.find(nid);
 
-            if (prev->offset + prev->size == hole.offset) {
-                hole.offset = prev->offset;
-                hole.size += prev->size;
-                hole_list_.erase(prev);
-            }
-        }
+    if (iter != block_entry_.end()) {
+        BlockHandle* handle = iter->second;
 
-        if (hole.offset + hole.size == iter->offset) {
-            iter->offset = hole.offset;
-            iter->size += hole.size;
-        } else {
-            hole_list_.insert(iter, hole);
-        }
-    } else {
-        if (prev->offset + prev->size == hole.offset)
-            prev->size += hole.size;
-        else 
-            hole_list_.push_back(hole);
+        add_fly_hole(handle->offset, PAGE_ROUND_UP(handle->size));
+        delete handle;
+        block_entry_.erase(iter);
+        dirty_nids_.insert(nid);
     }
+
+    free_nids_.push_back(nid);
 }
 
-bool Table::get_hole(uint32_t size, uint64_t& offset)
+nid_t Table::alloc_nid()
 {
-    ScopedMutex lock(hole_list_mutex_);
-    HoleList::iterator iter;
+    ScopedMutex lock(block_entry_mutex_);
 
-    for (iter = hole_list_.begin(); iter != hole_list_.end(); iter++) {
-        if (iter->size > size) {
-            iter->size -= size;
-            offset = iter->offset;
-            iter->offset += size;
-            return true;
-        } else if (iter->size == size) {
-            offset = iter->offset;
-            hole_list_.erase(iter);
-            return true;
-        }
-    }
-    return false;
+    if (free_nids_.empty())
+        return NID_NIL;
+
+    nid_t nid = free_nids_.back();
+    free_nids_.pop_back();
+    return nid;
+}
+
+bool Table::get_hole(uint32_t size, uint64_t& offset)
+{
+    ScopedMutex lock(holes_mutex_);
+    return holes_.allocate(size, offset);
 }
 
 void Table::add_fly_hole(uint64_t offset, uint32_t size)
@@ -384,9 +731,12 @@ void Table::truncate()
 {
     ScopedMutex lock(mutex_);
 
-    if (offset_ <= file_size_) {
+    // Truncating also drops the space preallocated past the end,
+    // so only do it if the file really shrinks.
+    if (offset_ < file_size_) {
         file_->truncate(offset_);
         file_size_ = offset_;
+        prealloc_end_ = offset_;
         LOG_INFO << Fmt("truncate, file size=%zuK", file_size_/1024);
     }
 }
@@ -405,22 +755,71 @@ uint32_t Table::block_header_size()
 
 Block* Table::read(nid_t nid)
 {
-    BlockHandle* handle;
+    // The handle may be freed by free_nid() once we release the lock.
+    BlockHandle handle;
+
+    if (!get_block_handle(nid, handle)) 
+        return NULL;
+
+    Block* block = read_block(&handle);
+
+    //LOG_INFO << Fmt("read node success, nid=%zu", nid);
+    return block;
+}
+
+bool Table::get_block_handle(nid_t nid, BlockHandle& handle)
+{
+    ScopedMutex lock(block_entry_mutex_);
+
+    BlockEntry::iterator iter = block_entry_.find(nid); 
+    if (iter == block_entry_.end()) return false;
 
+    handle = *(iter->second);
+    return true;
+}
+
+void Table::async_read(nid_t nid, ReadCallback cb)
+{
+    AsyncReadContext* context = new AsyncReadContext();
+
+    context->nid = nid;
+    context->callback = cb;
+
+    if (!get_block_handle(nid, context->handle)) {
+        cb(NULL);
+        delete context;
+        return;
+    }
+
+    context->alloc_ptr = self_alloc(context->handle.size);
+    assert(context->alloc_ptr.size());
     {
-        ScopedMutex lock(block_entry_mutex_);
+        ScopedMutex lock(mutex_);
+        fly_readers_++;
+    }
 
-        BlockEntry::iterator iter = block_entry_.find(nid); 
-        if (iter == block_entry_.end()) return NULL;
+    file_->async_read(context->handle.offset, context->alloc_ptr,
+                boost::bind(&Table::async_read_handler, this, context, _1));
+}
 
-        handle = iter->second;
-        assert(handle);
+void Table::async_read_handler(AsyncReadContext* context, Status status)
+{
+    {
+        ScopedMutex lock(mutex_);
+        fly_readers_--;
     }
 
-    Block* block = read_block(handle);
+    Block* block = NULL;
 
-    //LOG_INFO << Fmt("read node success, nid=%zu", nid);
-    return block;
+    if (status.succ && verify_block(context->handle, context->alloc_ptr.data())) {
+        block = new Block(context->alloc_ptr, 0, context->handle.size);
+    } else {
+        LOG_ERROR << "async_read error, " << Fmt("nid=%zu", context->nid);
+        self_dealloc(context->alloc_ptr);
+    }
+
+    context->callback(block);
+    delete context;
 }
 
 void Table::async_write(nid_t nid, Block& block, Callback cb)
@@ -432,6 +831,7 @@ void Table::async_write(nid_t nid, Block& block, Callback cb)
     context->nid = nid;
     context->callback = cb;
     context->handle.size = block.size();
+    context->handle.crc = crc32c::value(block.data(), block.size());
     context->handle.offset = find_space(block.buffer().size());
     {
         ScopedMutex lock(mutex_);
@@ -442,6 +842,84 @@ void Table::async_write(nid_t nid, Block& block, Callback cb)
                 boost::bind(&Table::async_write_handler, this, context, _1));
 }
 
+void Table::async_write_batch(const std::vector<nid_t>& nids, 
+                              const std::vector<Block*>& blocks,
+                              const std::vector<Callback>& callbacks)
+{
+    // Keep the iovec count of a write well below IOV_MAX.
+    const size_t kMaxBuffersPerWrite = 256;
+
+    size_t n = nids.size();
+    assert(blocks.size() == n && callbacks.size() == n);
+
+    if (n == 0) return;
+
+    std::vector<uint32_t> sizes(n);
+    std::vector<uint64_t> offsets(n);
+
+    for (size_t i = 0; i < n; i++) {
+        assert(blocks[i]->buffer().size() == PAGE_ROUND_UP(blocks[i]->size()));
+        sizes[i] = blocks[i]->buffer().size();
+    }
+
+    find_space(sizes, offsets);
+
+    std::vector<std::pair<uint64_t, size_t> > order;
+
+    for (size_t i = 0; i < n; i++) 
+        order.push_back(std::make_pair(offsets[i], i));
+    std::sort(order.begin(), order.end());
+
+    {
+        ScopedMutex lock(mutex_);
+        fly_writers_ += n;
+    }
+
+    std::vector<AIOFile::Write> writes;
+    std::vector<AsyncWriteContext*> contexts;
+    uint64_t next = 0;
+
+    for (size_t k = 0; k < n; k++) {
+        size_t i = order[k].second;
+
+        AsyncWriteContext* context = new AsyncWriteContext();
+
+        context->nid = nids[i];
+        context->callback = callbacks[i];
+        context->handle.offset = offsets[i];
+        context->handle.size = blocks[i]->size();
+        context->handle.crc = crc32c::value(blocks[i]->data(), blocks[i]->size());
+
+        // Start a new write unless the block follows the last one.
+        if (writes.empty() || offsets[i] != next || 
+            writes.back().buffers.size() == kMaxBuffersPerWrite) {
+            if (contexts.size()) {
+                writes.back().callback = boost::bind(
+                    &Table::async_write_batch_handler, this, contexts, _1);
+                contexts.clear();
+            }
+
+            writes.push_back(AIOFile::Write());
+            writes.back().offset = offsets[i];
+        }
+
+        writes.back().buffers.push_back(blocks[i]->buffer());
+        contexts.push_back(context);
+        next = offsets[i] + sizes[i];
+    }
+
+    writes.back().callback = boost::bind(
+        &Table::async_write_batch_handler, this, contexts, _1);
+
+    file_->async_write_batch(writes);
+}
+
+void Table::async_write_batch_handler(std::vector<AsyncWriteContext*> contexts, Status status)
+{
+    for (size_t i = 0; i < contexts.size(); i++)
+        async_write_handler(contexts[i], status);
+}
+
 void Table::async_write_handler(AsyncWriteContext* context, Status status)
 {
     {
@@ -465,9 +943,11 @@ void Table::async_write_handler(AsyncWriteContext* context, Status status)
             add_fly_hole(handle->offset, PAGE_ROUND_UP(handle->size));
             *handle = context->handle;
         }
+
+        dirty_nids_.insert(context->nid);
     } else {
         LOG_ERROR << "async_write error, " << Fmt("nid=%zu", context->nid);
-        add_hole(context->handle.offset, context->handle.size);
+        add_hole(context->handle.offset, PAGE_ROUND_UP(context->handle.size));
     }
 
     context->callback(status);
@@ -489,9 +969,101 @@ uint64_t Table::find_space(uint32_t size)
     if (offset_ > file_size_)
         file_size_ = offset_;
 
+    maybe_preallocate();
     return offset;
 }
 
+void Table::find_space(const std::vector<uint32_t>& sizes, std::vector<uint64_t>& offsets)
+{
+    uint64_t total = 0;
+    uint64_t offset;
+
+    offsets.resize(sizes.size());
+
+    for (size_t i = 0; i < sizes.size(); i++)
+        total += sizes[i];
+
+    if (total <= UINT32_MAX && get_hole(total, offset)) {
+        for (size_t i = 0; i < sizes.size(); i++) {
+            offsets[i] = offset;
+            offset += sizes[i];
+        }
+        return;
+    }
+
+    // Reuse the holes one by one, the rest is appended together.
+    std::vector<size_t> rest;
+    uint64_t rest_size = 0;
+
+    for (size_t i = 0; i < sizes.size(); i++) {
+        if (!get_hole(sizes[i], offsets[i])) {
+            rest.push_back(i);
+            rest_size += sizes[i];
+        }
+    }
+
+    if (rest.empty()) return;
+
+    ScopedMutex lock(mutex_);
+
+    offset = offset_;
+    offset_ += rest_size;
+
+    if (offset_ > file_size_)
+        file_size_ = offset_;
+
+    maybe_preallocate();
+
+    for (size_t i = 0; i < rest.size(); i++) {
+        offsets[rest[i]] = offset;
+        offset += sizes[rest[i]];
+    }
+}
+
+void Table::maybe_preallocate()
+{
+    const uint64_t kMinPrealloc = 1 << 20;
+    const uint64_t kMaxPrealloc = 64 << 20;
+
+    assert(mutex_.is_locked_by_this_thread());
+
+    if (offset_ <= prealloc_end_) 
+        return;
+
+    // Grow with the file, so small databases stay small.
+    uint64_t size = std::min(kMaxPrealloc, std::max(kMinPrealloc, offset_ / 8));
+    uint64_t start = std::max(prealloc_end_, PAGE_ROUND_DOWN(offset_));
+
+    size = PAGE_ROUND_UP(offset_ + size - start);
+
+    if (file_->allocate(start, size))
+        prealloc_end_ = start + size;
+    else
+        prealloc_end_ = offset_;
+}
+
+Block* Table::read(nid_t nid, uint32_t offset, uint32_t size)
+{
+    BlockHandle handle;
+
+    if (!get_block_handle(nid, handle) || offset >= handle.size) 
+        return NULL;
+
+    size = std::min(size, handle.size - offset);
+
+    uint32_t begin = PAGE_ROUND_DOWN(offset);
+    Slice alloc_ptr = self_alloc(offset + size - begin);
+    if (alloc_ptr.size() == 0) 
+        return NULL;
+
+    if (!read_file(handle.offset + begin, alloc_ptr)) {
+        self_dealloc(alloc_ptr);
+        return NULL;
+    }
+
+    return new Block(alloc_ptr, offset - begin, size);
+}
+
 Block* Table::read_block(const BlockHandle* handle)
 {
     Slice alloc_ptr = self_alloc(handle->size);
@@ -507,9 +1079,23 @@ Block* Table::read_block(const BlockHandle* handle)
         return NULL;
     }
 
+    if (!verify_block(*handle, alloc_ptr.data())) {
+        self_dealloc(alloc_ptr);
+        return NULL;
+    }
+
     return new Block(alloc_ptr, 0, handle->size);
 }
 
+bool Table::verify_block(const BlockHandle& handle, const char* data)
+{
+    if (crc32c::value(data, handle.size) == handle.crc)
+        return true;
+
+    LOG_ERROR << "checksum mismatch, " << Fmt("offset=%zu", handle.offset);
+    return false;
+}
+
 bool Table::read_file(uint64_t offset, Slice& buffer)
 {
     { 
@@ -554,6 +1140,9 @@ bool Table::write_file(uint64_t offset, const Slice& buffer)
 
 Slice Table::self_alloc(size_t size)
 {
+    if (pool_)
+        return pool_->alloc(size);
+
     size_t aligned_size = PAGE_ROUND_UP(size);
     void* alloc_ptr = NULL;
 
@@ -567,6 +1156,8 @@ Slice Table::self_alloc(size_t size)
 
 void Table::self_dealloc(Slice alloc_ptr)
 {
-    if (alloc_ptr.size())
+    if (pool_)
+        pool_->dealloc(alloc_ptr);
+    else if (alloc_ptr.size())
         free((char*)alloc_ptr.data());
 }
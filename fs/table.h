@@ -2,12 +2,16 @@
 #define _YODB_TABLE_H_
 
 #include "fs/file.h"
+#include "fs/allocator.h"
+#include "fs/buffer_pool.h"
 #include "tree/node.h"
 #include "util/block.h"
 
 #include <stdint.h>
 #include <map>
+#include <set>
 #include <deque>
+#include <vector>
 
 #include <boost/noncopyable.hpp>
 #include <boost/function.hpp>
@@ -23,24 +27,32 @@ namespace yodb {
 #define BOOTSTRAP_SIZE      PAGE_SIZE 
 
 struct BlockHandle {
-    BlockHandle() : offset(0), size(0) {}
+    BlockHandle() : offset(0), size(0), crc(0) {}
 
     uint64_t offset;
     uint32_t size;
+    uint32_t crc;       // crc32c of the size bytes at offset
 };
 
 class Bootstrap {
 public:
-    Bootstrap() : header(), root_nid(NID_NIL) {}
+    Bootstrap() : header(), root_nid(NID_NIL), hot(), delta() {}
 
     BlockHandle header;
     nid_t root_nid;
+
+    // nids of the nodes resident in cache, hottest first
+    BlockHandle hot;
+
+    // the latest delta of the index log, see Table::flush_header()
+    BlockHandle delta;
 };
 
 // Table for permanent storage
 class Table : boost::noncopyable {
 public:
-    Table(AIOFile* file, uint64_t file_size);
+    // i/o buffers are recycled by the pool if there is one.
+    Table(AIOFile* file, uint64_t file_size, BufferPool* pool = NULL);
     ~Table();
 
     bool init(bool create = false);
@@ -48,17 +60,44 @@ public:
     // Get node's block information marked by nid.
     Block* read(nid_t nid);
 
+    // Read size bytes at offset of the node's block, clipped to the block.
+    // Only whole pages are read, the block returned points to the bytes
+    // asked for. There is no checksum to verify, the caller checks them.
+    Block* read(nid_t nid, uint32_t offset, uint32_t size);
+
     typedef boost::function<void (Status)> Callback;
 
     // Asynchoronous write file, this will be always called by Cache module.
     void async_write(nid_t nid, Block& block, Callback cb);
 
+    // Write the blocks of a batch with as few vectored writes as possible,
+    // callbacks[i] is called when blocks[i] is written.
+    void async_write_batch(const std::vector<nid_t>& nids, 
+                           const std::vector<Block*>& blocks,
+                           const std::vector<Callback>& callbacks);
+
+    typedef boost::function<void (Block*)> ReadCallback;
+
+    // Asynchoronous read the node, block is NULL if anything goes wrong.
+    void async_read(nid_t nid, ReadCallback cb);
+
     bool flush_bootstrap();
     bool load_bootstrap();
 
+    // The index is kept as a full header plus a log of deltas, each 
+    // checkpoint only appends the entries written since the last one.
+    // The log is folded into a new header when it grows too long.
     bool flush_header();
     bool load_header();
 
+    // The hot nids list is written on every checkpoint, it is used 
+    // to warm up the cache after the database is opened again.
+    void set_hot_nids(const std::vector<nid_t>& nids);
+    std::vector<nid_t> get_hot_nids();
+
+    bool flush_hot_nids();
+    bool load_hot_nids();
+
     // Flush all the buffers to file.
     bool flush();
     bool flush_immediately();
@@ -66,9 +105,10 @@ public:
     void init_holes();
 
     // Holes are unused parts of our file, we collect it for further usage.
+    // Large holes are punched, so they don't occupy the disk any more.
     void add_hole(uint64_t offset, uint32_t size);
     
-    // Whether we can get suitable room from hole list.
+    // Whether we can get suitable room from the holes, the best fit is used.
     // This will be always called by find_space().
     bool get_hole(uint32_t size, uint64_t& offset);
 
@@ -83,21 +123,39 @@ public:
     nid_t get_root_nid() { return bootstrap_.root_nid; }
     void set_root_nid(nid_t nid) { bootstrap_.root_nid = nid; }
 
-    size_t get_node_count()  
+    // The largest nid on disk, new nids are counted from it.
+    nid_t get_max_nid()  
     {
         ScopedMutex lock(block_entry_mutex_);
-        return block_entry_.size();
+        return block_entry_.empty() ? NID_NIL : block_entry_.rbegin()->first;
     }
 
+    // The node is gone for good, its room becomes a fly hole and the
+    // nid is logged as removed, then it may be handed out again.
+    void free_nid(nid_t nid);
+
+    // Returns a freed nid, NID_NIL if there is none.
+    nid_t alloc_nid();
+
+    bool get_block_handle(nid_t nid, BlockHandle& handle);
+
     // Get size of all the block handle, this will be always called by flush_index().
     uint32_t block_header_size();
 
-    // Give a block handle, returns the the block you needed.
+    // Give a block handle, returns the the block you needed,
+    // NULL if it can't be read or the checksum mismatches.
     Block* read_block(const BlockHandle* handle);
 
+    // Whether the block read matches the checksum of the handle.
+    bool verify_block(const BlockHandle& handle, const char* data);
+
     // Get suitable room for size, return the offset of our file.
     uint64_t find_space(uint32_t size);
 
+    // Get room for a batch, the rooms are adjacent if possible:
+    // a hole large enough for all, or else appended together.
+    void find_space(const std::vector<uint32_t>& sizes, std::vector<uint64_t>& offsets);
+
     // Synchoronous read file
     bool read_file(uint64_t offset, Slice& buffer);
     // Synchoronous write file
@@ -105,11 +163,12 @@ public:
 
     void truncate();
 
-    // We use posix_memalign() to allocate aligned buffer, this is efficiency 
-    // since we are using asynchoronous read/write functions.
+    // We use page aligned buffers, this is efficiency since we are 
+    // using asynchoronous read/write functions. They come from the
+    // buffer pool, or else posix_memalign().
     Slice self_alloc(size_t size);
 
-    // posix_memalign() allocated buffer should use free() to deallocate.
+    // The buffer must be the one returned by self_alloc().
     void self_dealloc(Slice alloc_ptr);
 
     // size() function is seldom used, we remain it for debug reason.
@@ -117,8 +176,10 @@ public:
 
 private:
     AIOFile* file_; 
+    BufferPool* pool_;
     uint64_t file_size_;
     uint64_t offset_;
+    uint64_t prealloc_end_;     // disk space is reserved up to here
     Mutex mutex_;
 
     Bootstrap bootstrap_;
@@ -127,6 +188,34 @@ private:
     BlockEntry block_entry_;
     Mutex block_entry_mutex_;
 
+    // serialized size of a BlockHandle and of an index entry
+    static const uint32_t kBlockHandleSize = 8 + 4 + 4;
+    static const uint32_t kBlockEntrySize = sizeof(nid_t) + kBlockHandleSize;
+
+    bool flush_full_header();
+    bool flush_delta();
+    bool load_deltas();
+
+    // Write the entries as an index block, a delta also links to prev.
+    bool write_index(const std::vector<std::pair<nid_t, BlockHandle> >& entries,
+                     const BlockHandle* prev, uint32_t size, BlockHandle& handle);
+
+    // Apply the entries to block_entry_, block_entry_mutex_ is held.
+    bool read_entries(BlockReader& reader);
+
+    // nids written since the last index flush, guarded by block_entry_mutex_
+    std::set<nid_t> dirty_nids_;
+
+    // nids below get_max_nid() with no node, guarded by block_entry_mutex_
+    std::vector<nid_t> free_nids_;
+    void init_free_nids();
+
+    // the index log from the oldest, and its total size
+    std::vector<BlockHandle> deltas_;
+    uint32_t delta_size_;
+
+    Mutex checkpoint_mutex_;
+
     struct AsyncWriteContext {
         nid_t nid;
         Callback callback;
@@ -134,6 +223,20 @@ private:
     };
 
     void async_write_handler(AsyncWriteContext* context, Status status);
+    void async_write_batch_handler(std::vector<AsyncWriteContext*> contexts, Status status);
+
+    struct AsyncReadContext {
+        nid_t nid;
+        ReadCallback callback;
+        BlockHandle handle;
+        Slice alloc_ptr;
+    };
+
+    void async_read_handler(AsyncReadContext* context, Status status);
+
+    std::vector<nid_t> hot_nids_;
+    bool hot_nids_changed_;
+    Mutex hot_nids_mutex_;
 
     struct Hole {
         uint64_t offset;
@@ -143,12 +246,16 @@ private:
     uint32_t fly_readers_;
     uint32_t fly_writers_;
 
+    bool inited_;       // init() succeeded
+
+    // Reserve disk space ahead of the append offset, mutex_ is held.
+    void maybe_preallocate();
+
+    ExtentAllocator holes_;
+    Mutex holes_mutex_;
+
     typedef std::deque<Hole> HoleList;
-    // the holes is sorted by offset
-    HoleList hole_list_;
     HoleList fly_hole_list_;
-
-    Mutex hole_list_mutex_;
     Mutex fly_hole_list_mutex_;
 };
 
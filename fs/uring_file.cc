@@ -0,0 +1,475 @@
+#include "fs/uring_file.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <boost/bind.hpp>
+
+using namespace yodb;
+
+namespace {
+
+int io_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+} // namespace
+
+URingFile::URingFile(const std::string& path, unsigned entries, bool sqpoll)
+    : AIOFile(path), entries_(entries), sqpoll_(sqpoll), ring_fd_(-1),
+      sq_ptr_(NULL), sq_size_(0),
+      sq_head_(NULL), sq_tail_(NULL), sq_mask_(NULL), sq_flags_(NULL),
+      sq_array_(NULL), sqes_(NULL), sqes_size_(0),
+      cq_ptr_(NULL), cq_size_(0),
+      cq_head_(NULL), cq_tail_(NULL), cq_mask_(NULL), cqes_(NULL),
+      sq_entries_(0), inflight_(0), broken_(false),
+      closed_(true), thread_(NULL)
+{
+}
+
+URingFile::~URingFile()
+{
+    close();
+}
+
+bool URingFile::open()
+{
+    if (!open_file())
+        return false;
+
+    if (!setup_ring(sqpoll_)) {
+        // SQPOLL may need privileges we don't have.
+        if (!sqpoll_ || !setup_ring(false)) {
+            ::close(fd_);
+            return false;
+        }
+
+        LOG_INFO << "io_uring SQPOLL unavailable, disabled";
+        sqpoll_ = false;
+    }
+
+    closed_ = false;
+    broken_ = false;
+    thread_ = new Thread(boost::bind(&URingFile::reap, this));
+    assert(thread_);
+    thread_->run();
+
+    return true;
+}
+
+void URingFile::close()
+{
+    if (closed_ == false) {
+        closed_ = true;
+
+        // Wake up the reaper with a nop.
+        std::vector<struct io_uring_sqe> sqes(1);
+        memset(&sqes[0], 0, sizeof(struct io_uring_sqe));
+        sqes[0].opcode = IORING_OP_NOP;
+        sqes[0].user_data = 0;
+        submit(sqes);
+
+        thread_->join();
+        delete thread_;
+
+        // Nothing is left unless the reaper failed.
+        abort_requests(-ECANCELED);
+
+        destroy_ring();
+        ::close(fd_);
+    }
+}
+
+bool URingFile::setup_ring(bool sqpoll)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    if (sqpoll) {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = 1000; // ms
+    }
+
+    ring_fd_ = io_uring_setup(entries_, &p);
+    if (ring_fd_ < 0) {
+        LOG_ERROR << "io_uring_setup error: " << strerror(errno);
+        return false;
+    }
+
+    sq_entries_ = p.sq_entries;
+    sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+        sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+
+    sq_ptr_ = mmap(NULL, sq_size_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ptr_ == MAP_FAILED) {
+        LOG_ERROR << "mmap sq ring error: " << strerror(errno);
+        sq_ptr_ = NULL;
+        destroy_ring();
+        return false;
+    }
+
+    if (single) {
+        cq_ptr_ = sq_ptr_;
+    } else {
+        cq_ptr_ = mmap(NULL, cq_size_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+        if (cq_ptr_ == MAP_FAILED) {
+            LOG_ERROR << "mmap cq ring error: " << strerror(errno);
+            cq_ptr_ = NULL;
+            destroy_ring();
+            return false;
+        }
+    }
+
+    sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        LOG_ERROR << "mmap sqes error: " << strerror(errno);
+        destroy_ring();
+        return false;
+    }
+    sqes_ = (struct io_uring_sqe*)sqes;
+
+    char* sq = (char*)sq_ptr_;
+    sq_head_  = (unsigned*)(sq + p.sq_off.head);
+    sq_tail_  = (unsigned*)(sq + p.sq_off.tail);
+    sq_mask_  = (unsigned*)(sq + p.sq_off.ring_mask);
+    sq_flags_ = (unsigned*)(sq + p.sq_off.flags);
+    sq_array_ = (unsigned*)(sq + p.sq_off.array);
+
+    char* cq = (char*)cq_ptr_;
+    cq_head_ = (unsigned*)(cq + p.cq_off.head);
+    cq_tail_ = (unsigned*)(cq + p.cq_off.tail);
+    cq_mask_ = (unsigned*)(cq + p.cq_off.ring_mask);
+    cqes_    = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    // Slot i of the ring always holds sqe i.
+    for (unsigned i = 0; i < sq_entries_; i++)
+        sq_array_[i] = i;
+
+    return true;
+}
+
+void URingFile::destroy_ring()
+{
+    if (sqes_)
+        munmap(sqes_, sqes_size_);
+    if (cq_ptr_ && cq_ptr_ != sq_ptr_)
+        munmap(cq_ptr_, cq_size_);
+    if (sq_ptr_)
+        munmap(sq_ptr_, sq_size_);
+
+    sqes_ = NULL;
+    cq_ptr_ = NULL;
+    sq_ptr_ = NULL;
+
+    if (ring_fd_ >= 0)
+        ::close(ring_fd_);
+    ring_fd_ = -1;
+}
+
+bool URingFile::register_buffers(const std::vector<Slice>& regions)
+{
+    std::vector<struct iovec> iovs;
+
+    for (size_t i = 0; i < regions.size(); i++) {
+        struct iovec iov;
+        iov.iov_base = (void*)regions[i].data();
+        iov.iov_len = regions[i].size();
+        iovs.push_back(iov);
+    }
+
+    if (iovs.empty())
+        return false;
+
+    if (io_uring_register(ring_fd_, IORING_REGISTER_BUFFERS, &iovs[0], iovs.size()) < 0) {
+        LOG_ERROR << "register buffers error: " << strerror(errno);
+        return false;
+    }
+
+    regions_ = regions;
+    return true;
+}
+
+void URingFile::prep_rw(struct io_uring_sqe& sqe, bool write, AIORequest* request,
+                        uint64_t offset, const Slice& buffer)
+{
+    memset(&sqe, 0, sizeof(sqe));
+
+    sqe.fd = fd_;
+    sqe.off = offset;
+    sqe.user_data = (uint64_t)request;
+
+    for (size_t i = 0; i < regions_.size(); i++) {
+        const char* begin = regions_[i].data();
+        const char* end = begin + regions_[i].size();
+
+        if (buffer.data() >= begin && buffer.data() + buffer.size() <= end) {
+            sqe.opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+            sqe.addr = (uint64_t)buffer.data();
+            sqe.len = buffer.size();
+            sqe.buf_index = i;
+            return;
+        }
+    }
+
+    struct iovec iov;
+    iov.iov_base = (void*)buffer.data();
+    iov.iov_len = buffer.size();
+    request->iov.push_back(iov);
+
+    sqe.opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe.addr = (uint64_t)&request->iov[0];
+    sqe.len = 1;
+}
+
+void URingFile::async_read(uint64_t offset, Slice& buffer, Callback cb)
+{
+    AIORequest* request = new AIOReadRequest();
+    request->size = buffer.size();
+    request->callback = cb;
+
+    std::vector<struct io_uring_sqe> sqes(1);
+    prep_rw(sqes[0], false, request, offset, buffer);
+
+    submit(sqes);
+}
+
+void URingFile::async_write(uint64_t offset, const Slice& buffer, Callback cb)
+{
+    AIORequest* request = new AIOWriteRequest();
+    request->size = buffer.size();
+    request->callback = cb;
+
+    std::vector<struct io_uring_sqe> sqes(1);
+    prep_rw(sqes[0], true, request, offset, buffer);
+
+    submit(sqes);
+}
+
+void URingFile::async_write_batch(const std::vector<Write>& writes)
+{
+    std::vector<struct io_uring_sqe> sqes(writes.size());
+
+    for (size_t i = 0; i < writes.size(); i++) {
+        const Write& write = writes[i];
+        AIORequest* request = new AIOWriteRequest();
+
+        request->size = 0;
+        request->callback = write.callback;
+
+        assert(write.buffers.size());
+
+        if (write.buffers.size() == 1) {
+            request->size = write.buffers[0].size();
+            prep_rw(sqes[i], true, request, write.offset, write.buffers[0]);
+            continue;
+        }
+
+        for (size_t j = 0; j < write.buffers.size(); j++) {
+            struct iovec iov;
+            iov.iov_base = (void*)write.buffers[j].data();
+            iov.iov_len = write.buffers[j].size();
+
+            request->iov.push_back(iov);
+            request->size += iov.iov_len;
+        }
+
+        struct io_uring_sqe& sqe = sqes[i];
+        memset(&sqe, 0, sizeof(sqe));
+
+        sqe.opcode = IORING_OP_WRITEV;
+        sqe.fd = fd_;
+        sqe.off = write.offset;
+        sqe.addr = (uint64_t)&request->iov[0];
+        sqe.len = request->iov.size();
+        sqe.user_data = (uint64_t)request;
+    }
+
+    submit(sqes);
+}
+
+void URingFile::submit(std::vector<struct io_uring_sqe>& sqes)
+{
+    unsigned filled = 0;
+    bool broken;
+    {
+        ScopedMutex lock(sq_mutex_);
+
+        broken = broken_;
+        if (!broken) {
+            pending_.insert(pending_.end(), sqes.begin(), sqes.end());
+            filled = fill_ring();
+        }
+    }
+
+    // Nobody would reap them.
+    if (broken) {
+        for (size_t i = 0; i < sqes.size(); i++) {
+            AIORequest* request = (AIORequest*)sqes[i].user_data;
+            if (request == NULL) continue;
+
+            request->complete(-EIO);
+            delete request;
+        }
+        return;
+    }
+
+    if (filled)
+        enter();
+}
+
+unsigned URingFile::fill_ring()
+{
+    assert(sq_mutex_.is_locked_by_this_thread());
+
+    unsigned tail = *sq_tail_;
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    unsigned filled = 0;
+
+    while (!pending_.empty() && inflight_ < sq_entries_ &&
+           tail - head < sq_entries_) {
+        struct io_uring_sqe& sqe = pending_.front();
+        if (sqe.user_data)
+            requests_.insert((AIORequest*)sqe.user_data);
+
+        sqes_[tail & *sq_mask_] = sqe;
+        pending_.pop_front();
+
+        tail++;
+        inflight_++;
+        filled++;
+    }
+
+    if (filled)
+        __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+
+    return filled;
+}
+
+void URingFile::enter()
+{
+    if (sqpoll_) {
+        // The kernel thread picks up the sqes by itself unless it sleeps.
+        if (__atomic_load_n(sq_flags_, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP)
+            io_uring_enter(ring_fd_, 0, 0, IORING_ENTER_SQ_WAKEUP);
+        return;
+    }
+
+    // Submit everything not taken by the kernel yet,
+    // including the sqes left over by an earlier call.
+    unsigned tail = __atomic_load_n(sq_tail_, __ATOMIC_ACQUIRE);
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+
+    if (tail == head) return;
+
+    if (io_uring_enter(ring_fd_, tail - head, 0, 0) < 0) {
+        if (errno != EAGAIN && errno != EBUSY && errno != EINTR)
+            LOG_ERROR << "io_uring_enter error: " << strerror(errno);
+    }
+}
+
+void URingFile::reap()
+{
+    bool stopping = false;
+
+    while (true) {
+        if (io_uring_enter(ring_fd_, 0, 1, IORING_ENTER_GETEVENTS) < 0) {
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                LOG_ERROR << "io_uring_enter error: " << strerror(errno);
+                // The callers would wait for the requests forever.
+                abort_requests(-errno);
+                break;
+            }
+        }
+
+        std::vector<std::pair<AIORequest*, int> > done;
+        bool wakeup = false;
+
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        unsigned reaped = tail - head;
+
+        while (head != tail) {
+            struct io_uring_cqe* cqe = &cqes_[head & *cq_mask_];
+
+            if (cqe->user_data == 0)
+                wakeup = true;
+            else
+                done.push_back(std::make_pair((AIORequest*)cqe->user_data, cqe->res));
+            head++;
+        }
+
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+        // There is room in the rings again.
+        unsigned filled = 0;
+        bool idle;
+        {
+            ScopedMutex lock(sq_mutex_);
+
+            inflight_ -= reaped;
+            for (size_t i = 0; i < done.size(); i++)
+                requests_.erase(done[i].first);
+
+            filled = fill_ring();
+            idle = inflight_ == 0 && pending_.empty();
+        }
+
+        if (filled)
+            enter();
+
+        for (size_t i = 0; i < done.size(); i++) {
+            AIORequest* request = done[i].first;
+            request->complete(done[i].second);
+            delete request;
+        }
+
+        // Wait for the requests submitted before close() too.
+        if (wakeup && closed_)
+            stopping = true;
+        if (stopping && idle)
+            break;
+    }
+}
+
+void URingFile::abort_requests(int error)
+{
+    std::vector<AIORequest*> requests;
+    {
+        ScopedMutex lock(sq_mutex_);
+
+        broken_ = true;
+        requests.assign(requests_.begin(), requests_.end());
+        requests_.clear();
+
+        for (size_t i = 0; i < pending_.size(); i++) {
+            if (pending_[i].user_data)
+                requests.push_back((AIORequest*)pending_[i].user_data);
+        }
+        pending_.clear();
+    }
+
+    for (size_t i = 0; i < requests.size(); i++) {
+        requests[i]->complete(error);
+        delete requests[i];
+    }
+}
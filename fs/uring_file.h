@@ -0,0 +1,94 @@
+#ifndef _YODB_URING_FILE_H_
+#define _YODB_URING_FILE_H_
+
+#include "fs/file.h"
+
+#include <linux/io_uring.h>
+#include <deque>
+#include <set>
+#include <vector>
+
+namespace yodb {
+
+// io_uring backend, the rings are set up with raw system calls.
+// Completions are reaped by a thread blocked in io_uring_enter(),
+// so there is no polling and no limit but the ring size.
+class URingFile : public AIOFile {
+public:
+    URingFile(const std::string& path, unsigned entries, bool sqpoll);
+    ~URingFile();
+
+    bool open();
+    void close();
+
+    void async_read(uint64_t offset, Slice& buffer, Callback cb);
+    void async_write(uint64_t offset, const Slice& buffer, Callback cb);
+    void async_write_batch(const std::vector<Write>& writes);
+
+    // Reads and writes inside the regions use the fixed buffer opcodes.
+    bool register_buffers(const std::vector<Slice>& regions);
+
+private:
+    bool setup_ring(bool sqpoll);
+    void destroy_ring();
+
+    // Build the sqe of a single buffer, fixed if it is registered.
+    void prep_rw(struct io_uring_sqe& sqe, bool write, AIORequest* request,
+                 uint64_t offset, const Slice& buffer);
+
+    // Queue the sqes and submit what the rings can take, the rest
+    // waits until some requests complete.
+    void submit(std::vector<struct io_uring_sqe>& sqes);
+
+    // Move the pending sqes into the submission ring, sq_mutex_ is held.
+    // Returns the number of sqes moved.
+    unsigned fill_ring();
+
+    // Tell the kernel about the sqes in the submission ring.
+    void enter();
+
+    void reap();
+
+    // Complete the requests in the rings and the pending ones with the 
+    // error, no more are taken from now on.
+    void abort_requests(int error);
+
+    unsigned entries_;
+    bool sqpoll_;
+    int ring_fd_;
+
+    void* sq_ptr_;
+    size_t sq_size_;
+    unsigned* sq_head_;
+    unsigned* sq_tail_;
+    unsigned* sq_mask_;
+    unsigned* sq_flags_;
+    unsigned* sq_array_;
+    struct io_uring_sqe* sqes_;
+    size_t sqes_size_;
+
+    void* cq_ptr_;
+    size_t cq_size_;
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned* cq_mask_;
+    struct io_uring_cqe* cqes_;
+
+    // Requests in the rings never exceed sq_entries_,
+    // so the completion ring can't overflow.
+    unsigned sq_entries_;
+    unsigned inflight_;
+    std::deque<struct io_uring_sqe> pending_;
+    std::set<AIORequest*> requests_;    // in the rings
+    bool broken_;
+    Mutex sq_mutex_;
+
+    std::vector<Slice> regions_;
+
+    bool closed_;
+    Thread* thread_;
+};
+
+} // namespace yodb
+
+#endif // _YODB_URING_FILE_H_
@@ -3,6 +3,8 @@
 
 #include "sys/mutex.h"
 #include <pthread.h>
+#include <time.h>
+#include <errno.h>
 #include <boost/noncopyable.hpp>
 
 namespace yodb {
@@ -19,6 +21,20 @@ public:
 
     void wait()         { pthread_cond_wait(&cond_, mutex_.mutex()); }
     void notify()       { pthread_cond_signal(&cond_); }
+
+    // returns false if the time runs out before we get notified
+    bool wait_for_seconds(double seconds)
+    {
+        struct timespec abstime;
+        clock_gettime(CLOCK_REALTIME, &abstime);
+
+        int64_t nanoseconds = static_cast<int64_t>(seconds * 1000000000);
+        abstime.tv_sec += (abstime.tv_nsec + nanoseconds) / 1000000000;
+        abstime.tv_nsec = (abstime.tv_nsec + nanoseconds) % 1000000000;
+
+        return pthread_cond_timedwait(&cond_, mutex_.mutex(), &abstime) != ETIMEDOUT;
+    }
+
     void notify_all()   { pthread_cond_broadcast(&cond_); }
 
 private:
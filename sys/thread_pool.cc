@@ -0,0 +1,88 @@
+#include "sys/thread_pool.h"
+#include <boost/bind.hpp>
+
+using namespace yodb;
+
+namespace {
+
+__thread bool in_pool_worker = false;
+
+} // namespace
+
+ThreadPool::ThreadPool(const std::string& name, size_t threads)
+    : name_(name), count_(threads),
+      mutex_(), cond_(mutex_), running_(false)
+{
+}
+
+ThreadPool::~ThreadPool()
+{
+    if (running_)
+        stop();
+}
+
+void ThreadPool::start()
+{
+    assert(!running_);
+    running_ = true;
+
+    for (size_t i = 0; i < count_; i++) {
+        Thread* thread = new Thread(boost::bind(&ThreadPool::loop, this), name_);
+
+        thread->run();
+        threads_.push_back(thread);
+    }
+}
+
+void ThreadPool::stop()
+{
+    {
+        ScopedMutex lock(mutex_);
+        running_ = false;
+        cond_.notify_all();
+    }
+
+    for (size_t i = 0; i < threads_.size(); i++) {
+        threads_[i]->join();
+        delete threads_[i];
+    }
+    threads_.clear();
+}
+
+void ThreadPool::run(const Task& task)
+{
+    ScopedMutex lock(mutex_);
+
+    assert(running_);
+    tasks_.push_back(task);
+    cond_.notify();
+}
+
+bool ThreadPool::in_worker()
+{
+    return in_pool_worker;
+}
+
+void ThreadPool::loop()
+{
+    in_pool_worker = true;
+
+    while (true) {
+        Task task;
+
+        {
+            ScopedMutex lock(mutex_);
+
+            while (running_ && tasks_.empty())
+                cond_.wait();
+
+            if (tasks_.empty())
+                break;
+
+            task = tasks_.front();
+            tasks_.pop_front();
+        }
+
+        task();
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef _YODB_THREAD_POOL_H_
+#define _YODB_THREAD_POOL_H_
+
+#include "sys/thread.h"
+#include "sys/mutex.h"
+#include "sys/condition.h"
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace yodb {
+
+// A fixed number of threads running tasks in the order they were queued.
+class ThreadPool : boost::noncopyable {
+public:
+    typedef boost::function<void()> Task;
+
+    ThreadPool(const std::string& name, size_t threads);
+    ~ThreadPool();
+
+    void start();
+
+    // Tasks still queued are run before the threads exit.
+    void stop();
+
+    void run(const Task& task);
+
+    // Whether the calling thread is a worker of any pool.
+    static bool in_worker();
+
+private:
+    void loop();
+
+    std::string name_;
+    size_t count_;
+    std::vector<Thread*> threads_;
+
+    std::deque<Task> tasks_;
+    Mutex mutex_;
+    CondVar cond_;
+    bool running_;
+};
+
+} // namespace yodb
+
+#endif // _YODB_THREAD_POOL_H_
@@ -0,0 +1,57 @@
+#include "fs/allocator.h"
+#include <gtest/gtest.h>
+
+using namespace yodb;
+
+TEST(ExtentAllocator, BestFit)
+{
+    ExtentAllocator alloc;
+    uint64_t offset, size;
+
+    offset = 0, size = 4096;
+    alloc.free(offset, size);
+    offset = 8192, size = 16384;
+    alloc.free(offset, size);
+    offset = 65536, size = 8192;
+    alloc.free(offset, size);
+
+    EXPECT_EQ(3U, alloc.count());
+    EXPECT_EQ(28672U, alloc.total());
+
+    EXPECT_TRUE(alloc.allocate(8192, offset));
+    EXPECT_EQ(65536U, offset);
+
+    EXPECT_TRUE(alloc.allocate(4096, offset));
+    EXPECT_EQ(0U, offset);
+
+    EXPECT_TRUE(alloc.allocate(4096, offset));
+    EXPECT_EQ(8192U, offset);
+
+    EXPECT_FALSE(alloc.allocate(16384, offset));
+    EXPECT_EQ(1U, alloc.count());
+    EXPECT_EQ(12288U, alloc.total());
+}
+
+TEST(ExtentAllocator, Coalesce)
+{
+    ExtentAllocator alloc;
+    uint64_t offset, size;
+
+    offset = 0, size = 4096;
+    alloc.free(offset, size);
+    offset = 8192, size = 4096;
+    alloc.free(offset, size);
+    EXPECT_EQ(2U, alloc.count());
+
+    offset = 4096, size = 4096;
+    alloc.free(offset, size);
+    EXPECT_EQ(1U, alloc.count());
+    EXPECT_EQ(0U, offset);
+    EXPECT_EQ(12288U, size);
+
+    EXPECT_FALSE(alloc.remove_last(8192, offset));
+    EXPECT_TRUE(alloc.remove_last(12288, offset));
+    EXPECT_EQ(0U, offset);
+    EXPECT_EQ(0U, alloc.count());
+    EXPECT_EQ(0U, alloc.total());
+}
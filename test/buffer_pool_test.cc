@@ -0,0 +1,59 @@
+#include "fs/buffer_pool.h"
+#include <gtest/gtest.h>
+
+using namespace yodb;
+
+TEST(BufferPool, Recycle)
+{
+    BufferPool pool(1 << 20, false, 0);
+    pool.init(NULL);
+
+    Slice a = pool.alloc(5000);
+    EXPECT_EQ(8192U, a.size());
+    EXPECT_EQ(0U, (size_t)a.data() % 4096);
+
+    // 5000 and 7000 bytes fall in the same class
+    pool.dealloc(a);
+    Slice b = pool.alloc(7000);
+    EXPECT_EQ(a.data(), b.data());
+    EXPECT_EQ(8192U, b.size());
+
+    BufferPool::Stats stats = pool.stats();
+    EXPECT_EQ(1U, stats.hits);
+    EXPECT_EQ(1U, stats.misses);
+    EXPECT_EQ(8192U, stats.busy);
+    pool.dealloc(b);
+}
+
+TEST(BufferPool, Cap)
+{
+    BufferPool pool(8192, false, 0);
+    pool.init(NULL);
+
+    Slice a = pool.alloc(8192);
+    Slice b = pool.alloc(8192);
+    pool.dealloc(a);
+    pool.dealloc(b);
+
+    // only one idle buffer fits in the cap
+    BufferPool::Stats stats = pool.stats();
+    EXPECT_EQ(8192U, stats.idle);
+    EXPECT_EQ(0U, stats.busy);
+}
+
+TEST(BufferPool, Region)
+{
+    BufferPool pool(0, false, 1 << 16);
+    ASSERT_TRUE(pool.init(NULL));
+
+    Slice a = pool.alloc(4096);
+    Slice b = pool.alloc(4096);
+    EXPECT_EQ(a.data() + 4096, b.data());
+
+    // region buffers are kept even above the cap
+    pool.dealloc(a);
+    Slice c = pool.alloc(100);
+    EXPECT_EQ(a.data(), c.data());
+    pool.dealloc(b);
+    pool.dealloc(c);
+}
@@ -0,0 +1,122 @@
+#include "cache/secondary_cache.h"
+#include "db/db_impl.h"
+#include <stdio.h>
+#include <string>
+#include <gtest/gtest.h>
+
+using namespace yodb;
+
+static std::string key(size_t i)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%016zu", i);
+    return buf;
+}
+
+static Slice parked(const std::string& data)
+{
+    return Slice(data).clone();
+}
+
+TEST(SecondaryCache, PutReplaces)
+{
+    SecondaryCache cache(1024);
+
+    cache.put(1, parked("old"));
+    cache.put(1, parked("new"));
+    EXPECT_EQ(3U, cache.size());
+
+    Slice buffer;
+    ASSERT_TRUE(cache.take(1, buffer));
+    EXPECT_EQ("new", buffer.to_string());
+    buffer.release();
+
+    EXPECT_FALSE(cache.take(1, buffer));
+    EXPECT_EQ(0U, cache.size());
+}
+
+TEST(SecondaryCache, OversizeDropsOlder)
+{
+    SecondaryCache cache(16);
+
+    cache.put(1, parked("old"));
+    cache.put(1, parked(std::string(32, 'x')));
+
+    // the new copy doesn't fit, the old one must not stay behind
+    Slice buffer;
+    EXPECT_FALSE(cache.take(1, buffer));
+    EXPECT_EQ(0U, cache.size());
+}
+
+class SecondaryCacheDB : public testing::Test {
+protected:
+    SecondaryCacheDB() : env_("."), db_(NULL)
+    {
+        opts_.comparator = &cmp_;
+        opts_.env = &env_;
+        opts_.max_node_msg_count = 1024;
+        opts_.max_node_child_number = 8;
+        opts_.cache_limited_memory = 1 << 20;
+        opts_.secondary_cache_memory = 4 << 20;
+    }
+
+    void SetUp() { remove(kName); open(); }
+    void TearDown() { delete db_; remove(kName); }
+
+    void open()
+    {
+        delete db_;
+        db_ = new DBImpl(kName, opts_);
+        ASSERT_TRUE(db_->init());
+    }
+
+    // Keys below n which aren't a multiple of 3 hold value,
+    // or are deleted if it is empty.
+    size_t check(size_t n, const std::string& value)
+    {
+        size_t fails = 0;
+
+        for (size_t i = 0; i < n; i++) {
+            std::string k = key(i);
+            std::string expect = i % 3 ? value : k;
+            Slice v;
+
+            bool found = db_->get(Slice(k), v);
+            if (found != !expect.empty() ||
+                (found && v.to_string() != k + expect))
+                fails++;
+            if (found && v.size()) v.release();
+        }
+
+        return fails;
+    }
+
+    static const char* kName;
+    BytewiseComparator cmp_;
+    Env env_;
+    Options opts_;
+    DBImpl* db_;
+};
+
+const char* SecondaryCacheDB::kName = "secondary_cache_test.db";
+
+TEST_F(SecondaryCacheDB, DeleteAndReput)
+{
+    const size_t kCount = 50000;
+
+    for (size_t i = 0; i < kCount; i++)
+        db_->put(Slice(key(i)), Slice(key(i) + key(i)));
+
+    for (size_t i = 0; i < kCount; i++)
+        if (i % 3) db_->del(Slice(key(i)));
+
+    EXPECT_EQ(0U, check(kCount, ""));
+
+    for (size_t i = 0; i < kCount; i++)
+        if (i % 3) db_->put(Slice(key(i)), Slice(key(i) + "v"));
+
+    EXPECT_EQ(0U, check(kCount, "v"));
+
+    open();
+    EXPECT_EQ(0U, check(kCount, "v"));
+}
@@ -0,0 +1,82 @@
+#include "util/compress.h"
+#include <stdlib.h>
+#include <string>
+#include <gtest/gtest.h>
+
+using namespace yodb;
+
+static std::string roundtrip(CompressType type, const std::string& raw, size_t& framed)
+{
+    std::string dst(max_compressed_size(raw.size()), '\0');
+    framed = compress(type, raw.data(), raw.size(), &dst[0]);
+
+    CompressType t;
+    size_t size;
+    EXPECT_TRUE(compress_header(dst.data(), framed, t, size));
+    EXPECT_EQ(raw.size(), size);
+
+    std::string out(size, '\0');
+    EXPECT_TRUE(uncompress(dst.data(), framed, &out[0]));
+    return out;
+}
+
+TEST(Compress, Repeated)
+{
+    std::string raw;
+    for (int i = 0; i < 10000; i++)
+        raw += "key" + std::to_string(i % 100) + "value";
+
+    size_t framed;
+    EXPECT_EQ(raw, roundtrip(kLZ4Compress, raw, framed));
+    EXPECT_LT(framed, raw.size() / 4);
+}
+
+TEST(Compress, Overlapped)
+{
+    std::string raw(100000, 'a');
+    raw += "bcd";
+
+    size_t framed;
+    EXPECT_EQ(raw, roundtrip(kLZ4Compress, raw, framed));
+    EXPECT_LT(framed, 1000U);
+}
+
+TEST(Compress, Random)
+{
+    std::string raw;
+    srand(0);
+    for (int i = 0; i < 100000; i++)
+        raw.push_back(rand() & 0xff);
+
+    // random bytes don't compress, they are kept raw
+    size_t framed;
+    EXPECT_EQ(raw, roundtrip(kLZ4Compress, raw, framed));
+    EXPECT_EQ(raw.size() + kCompressHeaderSize, framed);
+}
+
+TEST(Compress, NoCompress)
+{
+    std::string raw(4096, 'x');
+
+    size_t framed;
+    EXPECT_EQ(raw, roundtrip(kNoCompress, raw, framed));
+    EXPECT_EQ(raw.size() + kCompressHeaderSize, framed);
+}
+
+TEST(Compress, Corrupted)
+{
+    std::string raw;
+    for (int i = 0; i < 1000; i++)
+        raw += std::to_string(i % 10);
+
+    std::string dst(max_compressed_size(raw.size()), '\0');
+    size_t framed = compress(kLZ4Compress, raw.data(), raw.size(), &dst[0]);
+
+    std::string out(raw.size(), '\0');
+    EXPECT_FALSE(uncompress(dst.data(), framed - 1, &out[0]));
+
+    dst[0] = 7;
+    CompressType type;
+    size_t size;
+    EXPECT_FALSE(compress_header(dst.data(), framed, type, size));
+}
@@ -0,0 +1,42 @@
+#include "util/crc32c.h"
+#include <string.h>
+#include <gtest/gtest.h>
+
+using namespace yodb;
+
+TEST(CRC32C, StandardResults)
+{
+    EXPECT_EQ(0xe3069283U, crc32c::value("123456789", 9));
+
+    char buf[32];
+
+    memset(buf, 0, sizeof(buf));
+    EXPECT_EQ(0x8a9136aaU, crc32c::value(buf, sizeof(buf)));
+
+    memset(buf, 0xff, sizeof(buf));
+    EXPECT_EQ(0x62a8ab43U, crc32c::value(buf, sizeof(buf)));
+}
+
+TEST(CRC32C, Extend)
+{
+    const char* s = "hello world, this is yodb";
+    size_t n = strlen(s);
+
+    for (size_t i = 0; i <= n; i++)
+        EXPECT_EQ(crc32c::value(s, n), crc32c::extend(crc32c::value(s, i), s + i, n - i));
+}
+
+TEST(CRC32C, Unaligned)
+{
+    char buf[64];
+    for (size_t i = 0; i < sizeof(buf); i++)
+        buf[i] = i * 7;
+
+    uint32_t crc = crc32c::value(buf + 1, 40);
+    char copy[48];
+    memcpy(copy + 3, buf + 1, 40);
+    EXPECT_EQ(crc, crc32c::value(copy + 3, 40));
+
+    buf[20] ^= 1;
+    EXPECT_NE(crc, crc32c::value(buf + 1, 40));
+}
@@ -69,6 +69,9 @@ static bool FLAGS_use_existing_db = false;
 // Use the db with the following name.
 static const char* FLAGS_db = NULL;
 
+// If true, use io_uring instead of Linux AIO for the data file.
+static bool FLAGS_use_io_uring = false;
+
 
 // Helper for quickly generating random values.
 class RandomGenerator {
@@ -301,15 +304,9 @@ private:
     fprintf(stdout, "RawSize:    %.1f MB (estimated)\n",
             ((static_cast<int64_t>(kKeySize + FLAGS_value_size) * num_)
              / 1048576.0));
-#ifdef HAS_SNAPPY
     fprintf(stdout, "FileSize:   %.1f MB (estimated)\n",
             (((kKeySize + FLAGS_value_size * FLAGS_compression_ratio) * num_)
              / 1048576.0));
-#else
-    fprintf(stdout, "FileSize:   %.1f MB (estimated, compression disabled)\n",
-            (((kKeySize + FLAGS_value_size) * num_)
-             / 1048576.0));
-#endif
     PrintWarnings();
     fprintf(stdout, "------------------------------------------------\n");
   }
@@ -324,10 +321,6 @@ private:
     fprintf(stdout,
             "WARNING: Assertions are enabled; benchmarks unnecessarily slow\n");
 #endif
-#ifndef HAS_SNAPPY
-    fprintf(stdout,
-            "WARNING: Snappy compression is disabled\n");
-#endif
 #ifndef HAS_LIBAIO
     fprintf(stdout,
             "WARNING: Linux AIO is disabled, Posix AIO (simulate AIO with user threads) is used instead\n");
@@ -536,9 +529,10 @@ private:
     Options opts;
     opts.env = env_;
     opts.comparator = comparator_;
-#ifdef HAS_SNAPPY
-    opts.compress = kSnappyCompress;
-#endif
+    opts.compress = kLZ4Compress;
+    if (FLAGS_use_io_uring) {
+        opts.aio_backend = kIOUring;
+    }
     if (FLAGS_cache_size) {
         opts.cache_limited_memory = FLAGS_cache_size;
     }
@@ -649,6 +643,9 @@ int main(int argc, char** argv)
         } else if (sscanf(argv[i], "--use_existing_db=%ld%c", &n, &junk) == 1 &&
                (n == 0 || n == 1)) {
           FLAGS_use_existing_db = n;
+        } else if (sscanf(argv[i], "--use_io_uring=%ld%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+          FLAGS_use_io_uring = n;
         } else if(sscanf(argv[i], "--cache_size=%ld%c", &n, &junk) == 1) {
             FLAGS_cache_size = n;
         } else if(sscanf(argv[i], "--num=%ld%c", &n, &junk) == 1) {
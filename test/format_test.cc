@@ -0,0 +1,100 @@
+#include "fs/env.h"
+#include "fs/table.h"
+#include "util/block.h"
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <gtest/gtest.h>
+
+using namespace yodb;
+
+static const char* kName = "format_test.db";
+
+// Write the bootstrap page as given, the rest of the page is zero.
+static void write_bootstrap(Env& env, const char* data, size_t size)
+{
+    AIOFile* file = env.open_aio_file(kName);
+    ASSERT_TRUE(file != NULL);
+
+    char* page = (char*)memalign(BOOTSTRAP_SIZE, BOOTSTRAP_SIZE);
+    memset(page, 0, BOOTSTRAP_SIZE);
+    memcpy(page, data, size);
+
+    Slice buffer(page, BOOTSTRAP_SIZE);
+    EXPECT_TRUE(file->write(0, buffer).succ);
+    EXPECT_TRUE(file->write(BOOTSTRAP_SIZE, buffer).succ);
+
+    free(page);
+    delete file;
+}
+
+static bool open_table(Env& env, bool create)
+{
+    AIOFile* file = env.open_aio_file(kName);
+    if (file == NULL) return false;
+
+    Table* table = new Table(file, create ? 0 : env.file_length(kName));
+    bool succ = table->init(create);
+
+    delete table;
+    delete file;
+    return succ;
+}
+
+class FormatTest : public testing::Test {
+protected:
+    FormatTest() : env_(".") {}
+
+    void SetUp() { remove(kName); }
+    void TearDown() { remove(kName); }
+
+    Env env_;
+};
+
+TEST_F(FormatTest, Reopen)
+{
+    EXPECT_TRUE(open_table(env_, true));
+    EXPECT_TRUE(open_table(env_, false));
+}
+
+TEST_F(FormatTest, OlderFileRefused)
+{
+    // The bootstrap before the format had a version: a bool,
+    // the offset and size of the index, and the root nid.
+    char data[32];
+    Block block(Slice(data, sizeof(data)));
+    BlockWriter writer(block);
+
+    writer << true << (uint64_t)BOOTSTRAP_SIZE << (uint32_t)100 << (uint64_t)1;
+    ASSERT_TRUE(writer.ok());
+
+    write_bootstrap(env_, data, sizeof(data));
+    EXPECT_FALSE(open_table(env_, false));
+
+    // and it is left as it was
+    char page[sizeof(data)];
+    FILE* file = fopen(kName, "rb");
+    ASSERT_TRUE(file != NULL);
+    EXPECT_EQ(sizeof(page), fread(page, 1, sizeof(page), file));
+    fclose(file);
+
+    EXPECT_EQ(0, memcmp(data, page, sizeof(data)));
+}
+
+TEST_F(FormatTest, OtherVersionRefused)
+{
+    ASSERT_TRUE(open_table(env_, true));
+
+    // Bump the version which follows the magic.
+    FILE* file = fopen(kName, "r+b");
+    ASSERT_TRUE(file != NULL);
+
+    char head[8];
+    ASSERT_EQ(sizeof(head), fread(head, 1, sizeof(head), file));
+    head[4]++;
+    fseek(file, 0, SEEK_SET);
+    fwrite(head, 1, sizeof(head), file);
+    fclose(file);
+
+    EXPECT_FALSE(open_table(env_, false));
+}
@@ -0,0 +1,146 @@
+#include "tree/msg.h"
+#include <stdio.h>
+#include <string>
+#include <gtest/gtest.h>
+
+using namespace yodb;
+
+static std::string key(size_t i)
+{
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%08zu", i);
+    return buf;
+}
+
+static bool get(MsgTable& table, const std::string& k, std::string& value)
+{
+    Msg msg;
+    if (!table.find(Slice(k), msg) || msg.type() != Put)
+        return false;
+
+    value = msg.value().to_string();
+    return true;
+}
+
+TEST(MsgTable, LeafDropsDel)
+{
+    BytewiseComparator cmp;
+    MsgTable table(&cmp, true);
+
+    table.lock();
+    for (size_t i = 0; i < 100; i++)
+        table.insert(Msg(Put, Slice(key(i)), Slice(key(i))));
+
+    for (size_t i = 0; i < 100; i += 2)
+        table.insert(Msg(Del, Slice(key(i))));
+    table.insert(Msg(Del, Slice(key(1000))));
+
+    EXPECT_EQ(50U, table.count());
+
+    std::string value;
+    EXPECT_FALSE(get(table, key(0), value));
+    EXPECT_TRUE(get(table, key(1), value));
+    EXPECT_EQ(key(1), value);
+    table.unlock();
+}
+
+TEST(MsgTable, FreezeThaw)
+{
+    BytewiseComparator cmp;
+    MsgTable table(&cmp, true);
+
+    table.lock();
+    for (size_t i = 0; i < 1000; i += 2)
+        table.insert(Msg(Put, Slice(key(i)), Slice(key(i) + "v")));
+
+    size_t size = table.size();
+    table.freeze();
+
+    EXPECT_EQ(500U, table.count());
+    EXPECT_EQ(size, table.size());
+
+    std::string value;
+    for (size_t i = 0; i < 1000; i++) {
+        EXPECT_EQ(i % 2 == 0, get(table, key(i), value));
+        if (i % 2 == 0) {
+            EXPECT_EQ(key(i) + "v", value);
+        }
+    }
+
+    // the first change thaws it
+    table.insert(Msg(Put, Slice(key(1)), Slice("x")));
+    table.insert(Msg(Del, Slice(key(0))));
+
+    EXPECT_EQ(500U, table.count());
+    EXPECT_TRUE(get(table, key(1), value));
+    EXPECT_EQ("x", value);
+    EXPECT_FALSE(get(table, key(0), value));
+    EXPECT_TRUE(get(table, key(998), value));
+    table.unlock();
+}
+
+TEST(MsgTable, FrozenRoundTrip)
+{
+    BytewiseComparator cmp;
+    MsgTable table(&cmp, true);
+
+    table.lock();
+    for (size_t i = 0; i < 100; i++)
+        table.insert(Msg(Put, Slice(key(i)), Slice(i % 3 ? key(i) : "")));
+    table.freeze();
+    table.unlock();
+
+    Slice buffer = Slice::alloc(table.size());
+    Block block(buffer, 0, table.size());
+    BlockWriter writer(block);
+    EXPECT_TRUE(table.destructor(writer));
+
+    // loaded with a backing, a leaf table is frozen at once
+    Backing backing((char*)buffer.data());
+    BlockReader reader(block);
+    MsgTable loaded(&cmp, true);
+    EXPECT_TRUE(loaded.constrcutor(reader, backing));
+
+    loaded.lock();
+    EXPECT_EQ(100U, loaded.count());
+
+    std::string value;
+    for (size_t i = 0; i < 100; i++) {
+        EXPECT_TRUE(get(loaded, key(i), value));
+        EXPECT_EQ(i % 3 ? key(i) : "", value);
+    }
+    loaded.unlock();
+}
+
+TEST(MsgTable, AppendLog)
+{
+    BytewiseComparator cmp;
+    MsgTable table(&cmp, false, true);
+
+    table.lock();
+    for (size_t i = 0; i < 100; i += 2)
+        table.insert(Msg(Put, Slice(key(i)), Slice("old")));
+
+    // sorted into the skiplist, the later writes go to the log
+    table.skiplist();
+    for (size_t i = 100; i > 0; i--)
+        table.insert(Msg(Put, Slice(key(i - 1)), Slice(key(i - 1))));
+    table.insert(Msg(Del, Slice(key(3))));
+
+    std::string value;
+    EXPECT_TRUE(get(table, key(2), value));
+    EXPECT_EQ(key(2), value);
+    EXPECT_FALSE(get(table, key(3), value));
+
+    MsgTable::Iterator iter(table.skiplist());
+    iter.seek_to_first();
+    for (size_t i = 0; i < 100; i++) {
+        ASSERT_TRUE(iter.valid());
+        EXPECT_EQ(key(i), iter.key().key().to_string());
+        EXPECT_EQ(i == 3 ? Del : Put, iter.key().type());
+        iter.next();
+    }
+    EXPECT_FALSE(iter.valid());
+    EXPECT_EQ(100U, table.count());
+    table.unlock();
+}
@@ -0,0 +1,261 @@
+#include "db/options.h"
+#include "fs/env.h"
+#include "fs/table.h"
+#include "fs/buffer_pool.h"
+#include "cache/cache.h"
+#include "tree/buffer_tree.h"
+#include "tree/node.h"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <gtest/gtest.h>
+
+using namespace yodb;
+
+static std::string key(size_t i)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%016zu", i);
+    return buf;
+}
+
+// Encode the node as write back does, the caller releases the buffer.
+static Slice encode(Node* node, CompressType type, size_t& size)
+{
+    node->read_lock();
+    size_t room = node->encode_size();
+    Slice buffer = Slice::alloc(room);
+    size = node->encode(type, (char*)buffer.data(), room);
+    node->read_unlock();
+
+    return buffer;
+}
+
+// Whether the node encodes to the bytes given.
+static bool same(Node* node, CompressType type, const char* data, size_t size)
+{
+    size_t encoded;
+    Slice buffer = encode(node, type, encoded);
+    bool equal = encoded == size && memcmp(buffer.data(), data, size) == 0;
+
+    buffer.release();
+    return equal;
+}
+
+class PartitionTest : public testing::Test {
+protected:
+    PartitionTest()
+        : env_("."), file_(NULL), pool_(NULL), table_(NULL),
+          cache_(NULL), tree_(NULL)
+    {
+        opts_.comparator = &cmp_;
+        opts_.env = &env_;
+        opts_.max_node_msg_count = 256;
+        opts_.max_node_child_number = 8;
+        opts_.compress = kLZ4Compress;
+        opts_.partitioned_nodes = true;
+    }
+
+    void SetUp() { remove(kName); open(); }
+    void TearDown() { close(); remove(kName); }
+
+    void open()
+    {
+        size_t size = 0;
+        if (env_.file_exists(kName))
+            size = env_.file_length(kName);
+
+        file_ = env_.open_aio_file(kName);
+        ASSERT_TRUE(file_ != NULL);
+
+        pool_ = new BufferPool(opts_.io_buffer_pool_memory, false, 0);
+        pool_->init(file_);
+
+        table_ = new Table(file_, size, pool_);
+        ASSERT_TRUE(table_->init(size == 0));
+
+        cache_ = new Cache(opts_);
+        ASSERT_TRUE(cache_->init());
+
+        tree_ = new BufferTree(kName, opts_, cache_, table_);
+        ASSERT_TRUE(tree_->init());
+    }
+
+    void close()
+    {
+        delete tree_;
+        delete cache_;
+        delete table_;
+        delete file_;
+        delete pool_;
+        tree_ = NULL;
+    }
+
+    void put(size_t n)
+    {
+        for (size_t i = 0; i < n; i++)
+            tree_->put(Slice(key(i)), Slice(key(i)));
+    }
+
+    // The block of the root on disk, and a node of it read by decode().
+    Node* read_root(Block*& block, bool partial)
+    {
+        nid_t nid = table_->get_root_nid();
+        size_t header_size;
+
+        block = table_->read(nid);
+        if (block == NULL ||
+            !Node::partitioned(block->data(), block->size(), header_size))
+            return NULL;
+
+        Node* node = tree_->create_node(nid);
+        size_t size = partial ? header_size : block->size();
+
+        if (!node->decode(block->data(), size, partial)) {
+            delete node;
+            return NULL;
+        }
+
+        return node;
+    }
+
+    void free_block(Block* block)
+    {
+        table_->self_dealloc(block->buffer());
+        delete block;
+    }
+
+    static const char* kName;
+    BytewiseComparator cmp_;
+    Env env_;
+    Options opts_;
+    AIOFile* file_;
+    BufferPool* pool_;
+    Table* table_;
+    Cache* cache_;
+    BufferTree* tree_;
+};
+
+const char* PartitionTest::kName = "partition_test.db";
+
+TEST_F(PartitionTest, RoundTrip)
+{
+    CompressType types[] = { kNoCompress, kLZ4Compress };
+
+    // a leaf root first, then an interior one
+    for (size_t n = 100; n <= 10000; n *= 100) {
+        put(n);
+
+        for (size_t t = 0; t < 2; t++) {
+            Node* root = tree_->get_root();
+            size_t size, header_size;
+            Slice buffer = encode(root, types[t], size);
+
+            ASSERT_GT(size, 0U);
+            EXPECT_TRUE(Node::partitioned(buffer.data(), size, header_size));
+            EXPECT_LT(header_size, size);
+
+            Node* node = tree_->create_node(root->nid());
+            ASSERT_TRUE(node->decode(buffer.data(), size, false));
+
+            EXPECT_FALSE(node->partial());
+            EXPECT_EQ(root->height(), node->height());
+            EXPECT_EQ(root->pivot_count(), node->pivot_count());
+            EXPECT_TRUE(same(node, types[t], buffer.data(), size));
+
+            // a table frame which doesn't match its crc is refused
+            char* data = (char*)buffer.data();
+            data[size - 1] ^= 0xff;
+
+            Node* bad = tree_->create_node(root->nid());
+            EXPECT_FALSE(bad->decode(data, size, false));
+
+            delete bad;
+            delete node;
+            buffer.release();
+            root->dec_ref();
+        }
+    }
+}
+
+TEST_F(PartitionTest, PartialLoad)
+{
+    const size_t kCount = 10000;
+
+    put(kCount);
+    close();
+    open();
+
+    Block* block;
+    Node* node = read_root(block, true);
+    ASSERT_TRUE(node != NULL);
+    ASSERT_GT(node->pivot_count(), 1U);
+
+    EXPECT_TRUE(node->partial());
+    size_t header_usage = node->size();
+
+    // A lookup reads only the table of its pivot.
+    Slice value;
+    nid_t missing = NID_NIL;
+
+    if (node->get(Slice(key(kCount - 1)), value, NULL, missing))
+        value.release();
+
+    EXPECT_TRUE(node->partial());
+    EXPECT_GT(node->size(), header_usage);
+
+    EXPECT_TRUE(node->load_partitions());
+    EXPECT_FALSE(node->partial());
+    EXPECT_TRUE(same(node, opts_.compress, block->data(), block->size()));
+
+    delete node;
+    free_block(block);
+}
+
+TEST_F(PartitionTest, EvictAndReload)
+{
+    const size_t kCount = 10000;
+
+    put(kCount);
+    close();
+    open();
+
+    Block* block;
+    Node* node = read_root(block, false);
+    ASSERT_TRUE(node != NULL);
+    EXPECT_FALSE(node->partial());
+
+    size_t usage = node->size();
+    std::vector<MsgTable*> tables;
+
+    // None of the tables is looked up yet, they all go.
+    size_t evicted = node->evict_tables(tables);
+    EXPECT_GT(evicted, 0U);
+    EXPECT_TRUE(node->partial());
+    EXPECT_EQ(usage - evicted, node->size());
+
+    for (size_t i = 0; i < tables.size(); i++)
+        delete tables[i];
+    tables.clear();
+
+    EXPECT_TRUE(node->load_partitions());
+    EXPECT_FALSE(node->partial());
+    EXPECT_EQ(usage, node->size());
+
+    // The table looked up stays through one pass, the last keys put
+    // are still in the buffer of the root.
+    Slice value;
+    nid_t missing = NID_NIL;
+    if (node->get(Slice(key(kCount - 1)), value, NULL, missing))
+        value.release();
+
+    size_t again = node->evict_tables(tables);
+    for (size_t i = 0; i < tables.size(); i++)
+        delete tables[i];
+
+    EXPECT_LT(again, evicted);
+    EXPECT_TRUE(node->load_partitions());
+
+    delete node;
+    free_block(block);
+}
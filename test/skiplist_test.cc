@@ -100,6 +100,73 @@ void test_insert_erase()
         assert(iter.key() == i);
         iter.next();
     }
+    assert(!iter.valid());
+
+    // every level is cut
+    assert(!list.contains(N / 2));
+    assert(!list.contains(N - 1));
+    iter.seek_to_last();
+    assert(iter.key() == N / 2 - 1);
+
+    list.insert(N);
+    assert(list.contains(N) && list.count() == N / 2 + 1);
+}
+
+void test_merge()
+{
+    const size_t N = 1000;
+    Comparator cmp;
+    SkipList<Key, Comparator> list(cmp);
+
+    for (size_t i = 0; i < N; i += 3)
+        list.insert(i);
+
+    size_t count = list.count();
+    size_t replaced = 0;
+    SkipList<Key, Comparator>::Merger merger(&list);
+
+    for (size_t i = 0; i < N; i += 2) {
+        Key old;
+        if (merger.insert(i, old)) {
+            assert(old == i);
+            replaced++;
+        } else {
+            count++;
+        }
+    }
+
+    assert(replaced == (N + 5) / 6);
+    assert(list.count() == count);
+
+    SkipList<Key, Comparator>::Iterator iter(&list);
+    iter.seek_to_first();
+    for (size_t i = 0; i < N; i++) {
+        if (i % 2 && i % 3) continue;
+        assert(iter.key() == i);
+        assert(list.contains(i));
+        iter.next();
+    }
+    assert(!iter.valid());
+
+    SkipList<Key, Comparator>::Merger eraser(&list);
+
+    for (size_t i = 0; i < N; i += 4) {
+        Key old;
+        if (eraser.erase(i, old)) {
+            assert(old == i);
+            count--;
+        }
+    }
+
+    assert(list.count() == count);
+
+    iter.seek_to_first();
+    for (size_t i = 0; i < N; i++) {
+        if ((i % 2 && i % 3) || i % 4 == 0) continue;
+        assert(iter.key() == i);
+        iter.next();
+    }
+    assert(!iter.valid());
 }
 
 int main()
@@ -1,5 +1,7 @@
 #include <gtest/gtest.h>
 #include "sys/thread.h"
+#include "sys/thread_pool.h"
+#include <boost/bind.hpp>
 
 using namespace yodb;
 
@@ -17,3 +19,30 @@ TEST(Thread, run)
     thr.join();
     EXPECT_EQ(count1, 1); 
 }
+
+static Mutex count2_mutex;
+static int count2;
+static bool worker;
+
+static void pool_fn(int n)
+{
+    ScopedMutex lock(count2_mutex);
+    count2 += n;
+    worker = ThreadPool::in_worker();
+}
+
+TEST(ThreadPool, run)
+{
+    ThreadPool pool("test", 4);
+    count2 = 0;
+    pool.start();
+
+    for (int i = 1; i <= 100; i++)
+        pool.run(boost::bind(pool_fn, i));
+
+    // queued tasks are finished by stop()
+    pool.stop();
+    EXPECT_EQ(count2, 5050);
+    EXPECT_TRUE(worker);
+    EXPECT_FALSE(ThreadPool::in_worker());
+}
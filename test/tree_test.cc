@@ -0,0 +1,163 @@
+#include "db/options.h"
+#include "fs/env.h"
+#include "fs/table.h"
+#include "fs/buffer_pool.h"
+#include "cache/cache.h"
+#include "tree/buffer_tree.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <string>
+#include <gtest/gtest.h>
+
+using namespace yodb;
+
+static std::string key(size_t i)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%016zu", i);
+    return buf;
+}
+
+// The parts DBImpl puts together, open to the test.
+class MergeTest : public testing::Test {
+protected:
+    MergeTest()
+        : env_("."), file_(NULL), pool_(NULL), table_(NULL),
+          cache_(NULL), tree_(NULL)
+    {
+        opts_.comparator = &cmp_;
+        opts_.env = &env_;
+        opts_.max_node_msg_count = 256;
+        opts_.max_node_child_number = 8;
+        opts_.merge_interval = 1;
+    }
+
+    void SetUp() { remove(kName); open(); }
+    void TearDown() { close(); remove(kName); }
+
+    void open()
+    {
+        size_t size = 0;
+        if (env_.file_exists(kName))
+            size = env_.file_length(kName);
+
+        file_ = env_.open_aio_file(kName);
+        ASSERT_TRUE(file_ != NULL);
+
+        pool_ = new BufferPool(opts_.io_buffer_pool_memory, false, 0);
+        pool_->init(file_);
+
+        table_ = new Table(file_, size, pool_);
+        ASSERT_TRUE(table_->init(size == 0));
+
+        cache_ = new Cache(opts_);
+        ASSERT_TRUE(cache_->init());
+
+        tree_ = new BufferTree(kName, opts_, cache_, table_);
+        ASSERT_TRUE(tree_->init());
+    }
+
+    void close()
+    {
+        delete tree_;
+        delete cache_;
+        delete table_;
+        delete file_;
+        delete pool_;
+        tree_ = NULL;
+    }
+
+    // Keys below n which are a multiple of step hold themselves,
+    // the others are deleted.
+    size_t check(size_t n, size_t step)
+    {
+        size_t fails = 0;
+
+        for (size_t i = 0; i < n; i++) {
+            std::string k = key(i);
+            Slice value;
+
+            bool found = tree_->get(Slice(k), value);
+            if (found != (i % step == 0) ||
+                (found && value.to_string() != k))
+                fails++;
+            if (found && value.size()) value.release();
+        }
+
+        return fails;
+    }
+
+    static const char* kName;
+    BytewiseComparator cmp_;
+    Env env_;
+    Options opts_;
+    AIOFile* file_;
+    BufferPool* pool_;
+    Table* table_;
+    Cache* cache_;
+    BufferTree* tree_;
+};
+
+const char* MergeTest::kName = "merge_test.db";
+
+TEST_F(MergeTest, ShrinkAfterDeletes)
+{
+    const size_t kCount = 20000;
+    const size_t kStep = 100;
+
+    for (size_t i = 0; i < kCount; i++)
+        tree_->put(Slice(key(i)), Slice(key(i)));
+
+    uint32_t height = tree_->height();
+    ASSERT_GE(height, 2U);
+
+    for (size_t i = 0; i < kCount; i++)
+        if (i % kStep) tree_->del(Slice(key(i)));
+
+    // The deletes sit in the buffers until more messages push them down
+    // to the leaves, deleting keys which don't exist does no harm. 
+    // The merger goes on in the background.
+    for (size_t round = 0; round < 30 && tree_->height() >= height; round++) {
+        std::string suffix(1, 'a' + round);
+
+        for (size_t i = 0; i < kCount; i++)
+            tree_->del(Slice(key(i) + suffix));
+
+        EXPECT_EQ(0U, check(kCount, kStep));
+        sleep(1);
+    }
+
+    EXPECT_LT(tree_->height(), height);
+    EXPECT_EQ(0U, check(kCount, kStep));
+
+    // The nids of the nodes merged away are handed out again,
+    // once the write back thread has freed them.
+    nid_t nid = NID_NIL;
+    for (size_t i = 0; i < 30 && nid == NID_NIL; i++) {
+        nid = table_->alloc_nid();
+        if (nid == NID_NIL) usleep(100 * 1000);
+    }
+
+    ASSERT_NE(NID_NIL, nid);
+    BlockHandle handle;
+    EXPECT_FALSE(table_->get_block_handle(nid, handle));
+    table_->free_nid(nid);
+
+    uint32_t shrunk = tree_->height();
+
+    close();
+    open();
+
+    EXPECT_LE(tree_->height(), shrunk);
+    EXPECT_EQ(0U, check(kCount, kStep));
+
+    // The tree grows again, onto the recycled nids.
+    for (size_t i = 0; i < kCount; i++)
+        tree_->put(Slice(key(i)), Slice(key(i)));
+
+    EXPECT_EQ(0U, check(kCount, 1));
+
+    close();
+    open();
+    EXPECT_EQ(0U, check(kCount, 1));
+}
@@ -0,0 +1,157 @@
+#include "fs/uring_file.h"
+#include "sys/mutex.h"
+#include "sys/condition.h"
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <gtest/gtest.h>
+#include <boost/bind.hpp>
+
+using namespace yodb;
+
+static const size_t kBlockSize = 4096;
+static const char* kPath = "./uring_test.db";
+
+// O_DIRECT wants aligned buffers.
+static Slice aligned(char c)
+{
+    char* ptr = (char*)memalign(kBlockSize, kBlockSize);
+    memset(ptr, c, kBlockSize);
+    return Slice(ptr, kBlockSize);
+}
+
+static bool filled(const Slice& buffer, char c)
+{
+    for (size_t i = 0; i < buffer.size(); i++)
+        if (buffer.data()[i] != c) return false;
+    return true;
+}
+
+// Counts the completions of the async requests.
+class Waiter {
+public:
+    Waiter() : mutex_(), cond_(mutex_), done_(0), failed_(0) {}
+
+    void complete(Status status)
+    {
+        ScopedMutex lock(mutex_);
+        done_++;
+        if (!status.succ) failed_++;
+        cond_.notify_all();
+    }
+
+    // Returns the failed requests.
+    size_t wait(size_t count)
+    {
+        ScopedMutex lock(mutex_);
+        while (done_ < count)
+            cond_.wait();
+        return failed_;
+    }
+
+private:
+    Mutex mutex_;
+    CondVar cond_;
+    size_t done_;
+    size_t failed_;
+};
+
+class URingTest : public testing::Test {
+protected:
+    URingTest() : file_(NULL) {}
+
+    void SetUp()
+    {
+        remove(kPath);
+
+        // A small ring, so requests queue up behind it.
+        file_ = new URingFile(kPath, 4, false);
+        if (!file_->open()) {
+            delete file_;
+            file_ = NULL;
+        }
+    }
+
+    void TearDown()
+    {
+        delete file_;
+        remove(kPath);
+    }
+
+    URingFile* file_;
+};
+
+TEST_F(URingTest, ReadWrite)
+{
+    if (file_ == NULL) GTEST_SKIP() << "io_uring unavailable";
+
+    Slice out = aligned('a');
+    Slice in = aligned(0);
+
+    EXPECT_TRUE(file_->write(kBlockSize, out).succ);
+
+    Status status = file_->read(kBlockSize, in);
+    EXPECT_TRUE(status.succ);
+    EXPECT_EQ(kBlockSize, status.size);
+    EXPECT_TRUE(filled(in, 'a'));
+
+    free((void*)out.data());
+    free((void*)in.data());
+}
+
+TEST_F(URingTest, WriteBatch)
+{
+    if (file_ == NULL) GTEST_SKIP() << "io_uring unavailable";
+
+    const size_t kWrites = 16;
+    std::vector<AIOFile::Write> writes(kWrites);
+    std::vector<Slice> buffers;
+    Waiter waiter;
+
+    // Two blocks a write, more writes than the ring takes at once.
+    for (size_t i = 0; i < kWrites; i++) {
+        writes[i].offset = i * 2 * kBlockSize;
+        writes[i].callback = boost::bind(&Waiter::complete, &waiter, _1);
+
+        for (size_t j = 0; j < 2; j++) {
+            buffers.push_back(aligned('a' + i));
+            writes[i].buffers.push_back(buffers.back());
+        }
+    }
+
+    file_->async_write_batch(writes);
+    EXPECT_EQ(0U, waiter.wait(kWrites));
+
+    Slice in = aligned(0);
+
+    for (size_t i = 0; i < kWrites * 2; i++) {
+        EXPECT_TRUE(file_->read(i * kBlockSize, in).succ);
+        EXPECT_TRUE(filled(in, 'a' + i / 2));
+    }
+
+    free((void*)in.data());
+    for (size_t i = 0; i < buffers.size(); i++)
+        free((void*)buffers[i].data());
+}
+
+TEST_F(URingTest, CloseCompletesAll)
+{
+    if (file_ == NULL) GTEST_SKIP() << "io_uring unavailable";
+
+    const size_t kWrites = 64;
+    std::vector<Slice> buffers;
+    Waiter waiter;
+
+    for (size_t i = 0; i < kWrites; i++) {
+        buffers.push_back(aligned('x'));
+        file_->async_write(i * kBlockSize, buffers.back(),
+                           boost::bind(&Waiter::complete, &waiter, _1));
+    }
+
+    // Every request completes, those queued behind the ring as well.
+    file_->close();
+    EXPECT_EQ(0U, waiter.wait(kWrites));
+
+    for (size_t i = 0; i < buffers.size(); i++)
+        free((void*)buffers[i].data());
+}
@@ -1,18 +1,36 @@
 #include "tree/buffer_tree.h"
 
+#include <boost/bind.hpp>
+
 using namespace yodb;
 
 BufferTree::BufferTree(const std::string name, Options& opts, 
                        Cache* cache, Table* table)
     : name_(name), options_(opts), 
       cache_(cache), table_(table),
-      root_(NULL), node_count_(0), 
-      node_map_(), mutex_(), mutex_lock_path_()
+      root_(NULL), pool_(NULL), node_count_(0), 
+      node_map_(), mutex_(), mutex_lock_path_(),
+      alive_(false), merger_(NULL), merge_mutex_(), merge_cond_(merge_mutex_)
 {
 }
 
 BufferTree::~BufferTree()
 {
+    if (merger_) {
+        {
+            ScopedMutex lock(merge_mutex_);
+            alive_ = false;
+            merge_cond_.notify();
+        }
+        merger_->join();
+        delete merger_;
+    }
+
+    if (pool_) {
+        pool_->stop();
+        delete pool_;
+    }
+
     // root_ is always referenced
     if (root_) {
         root_->dec_ref();
@@ -31,8 +49,13 @@ bool BufferTree::init()
 {
     cache_->integrate(this, table_);
 
+    if (options_.push_down_threads) {
+        pool_ = new ThreadPool("push_down", options_.push_down_threads);
+        pool_->start();
+    }
+
     nid_t root_nid = table_->get_root_nid();
-    node_count_ = table_->get_node_count();
+    node_count_ = table_->get_max_nid();
 
     root_ = get_node_by_nid(root_nid);
 
@@ -45,7 +68,18 @@ bool BufferTree::init()
         root_->create_first_pivot();
     }
 
-    return root_ != NULL;
+    if (root_ == NULL)
+        return false;
+
+    cache_->warm_up();
+
+    if (options_.merge_interval) {
+        alive_ = true;
+        merger_ = new Thread(boost::bind(&BufferTree::merge_back, this));
+        merger_->run();
+    }
+
+    return true;
 }
 
 void BufferTree::grow_up(Node* root)
@@ -57,14 +91,30 @@ void BufferTree::grow_up(Node* root)
     table_->set_root_nid(root_->nid());
 }
 
+Node* BufferTree::get_root()
+{
+    ScopedMutex lock(mutex_);
+
+    root_->inc_ref();
+    return root_;
+}
+
+uint32_t BufferTree::height()
+{
+    ScopedMutex lock(mutex_);
+    return root_ ? root_->height() : 0;
+}
+
 Node* BufferTree::create_node()
 {
-    {
+    // The nids of the nodes merged away are used first.
+    nid_t nid = table_->alloc_nid();
+
+    if (nid == NID_NIL) {
         ScopedMutex lock(mutex_);
-        ++node_count_;
+        nid = ++node_count_;
     }
 
-    nid_t nid = node_count_;
     Node* node = new Node(this, nid);
 
     cache_->put(nid, node);
@@ -82,15 +132,22 @@ Node* BufferTree::get_node_by_nid(nid_t nid)
     return cache_->get(nid);
 }
 
+Node* BufferTree::get_resident_node(nid_t nid)
+{
+    return cache_->lookup(nid);
+}
+
 void BufferTree::lock_path(const Slice& key, std::vector<Node*>& path)
 {
     ScopedMutex lock(mutex_lock_path_);
 
-    Node* root = root_;
-    root->inc_ref();
+    Node* root = get_root();
     root->write_lock();
 
-    if (root != root_) {
+    Node* current = get_root();
+    current->dec_ref();
+
+    if (root != current) {
         // Tree maybe grow up after we get the lock, 
         // so we just give up if we miss this action.
         root->write_unlock();
@@ -100,15 +157,103 @@ void BufferTree::lock_path(const Slice& key, std::vector<Node*>& path)
     }
 }
 
+void BufferTree::unlock_path(std::vector<Node*>& path)
+{
+    while (!path.empty()) {
+        Node* node = path.back();
+        node->write_unlock();
+        node->dec_ref();
+        path.pop_back();
+    }
+}
+
+void BufferTree::merge_back()
+{
+    while (true) {
+        {
+            ScopedMutex lock(merge_mutex_);
+
+            if (alive_)
+                merge_cond_.wait_for_seconds(options_.merge_interval);
+            if (!alive_)
+                break;
+        }
+
+        merge_underfull();
+    }
+}
+
+void BufferTree::merge_underfull()
+{
+    Node* root = get_root();
+
+    // Only what is in memory is looked at, so nothing is read from disk
+    // but the paths of the merges.
+    Node::MergeList merges;
+    root->collect_merges(merges);
+
+    bool single = root->height() > 0 && root->pivot_count() == 1;
+    root->dec_ref();
+
+    for (size_t i = 0; i < merges.size() && alive_; i++)
+        merge_at(merges[i].first, merges[i].second);
+
+    if (single || merges.size())
+        shrink();
+}
+
+void BufferTree::merge_at(const std::string& key, uint32_t height)
+{
+    std::vector<Node*> path;
+    lock_path(key, path);
+
+    for (size_t i = 0; i + 1 < path.size(); i++) {
+        if (path[i]->height() != height) 
+            continue;
+
+        Node* node = path[i + 1];
+
+        if (path[i]->merge_child(key, node)) {
+            // Stay on the path, it is unlocked below.
+            cache_->retire(node);
+        }
+        break;
+    }
+
+    unlock_path(path);
+}
+
+void BufferTree::shrink()
+{
+    std::vector<Node*> path;
+    lock_path(Slice(), path);
+
+    // lock_path() has pushed the buffer of the single pivot down.
+    if (path.size() >= 2 && path[0]->pivot_count() == 1) {
+        Node* root = path[0];
+        Node* child = path[1];
+
+        {
+            ScopedMutex lock(mutex_);
+
+            child->inc_ref();
+            root_ = child;
+            table_->set_root_nid(child->nid());
+        }
+
+        root->dec_ref();
+        cache_->retire(root);
+    }
+
+    unlock_path(path);
+}
+
 bool BufferTree::put(const Slice& key, const Slice& value)
 {
-    assert(root_);
-    
     // Tree maybe grow up after we insert a kv,
     // so we should use the copy of the root_ to
     // ensure dec_ref() right processed.(same as below)
-    Node* root = root_;
-    root->inc_ref();
+    Node* root = get_root();
     bool succ = root->put(key, value);
     root->dec_ref();
 
@@ -117,10 +262,7 @@ bool BufferTree::put(const Slice& key, const Slice& value)
 
 bool BufferTree::del(const Slice& key)
 {
-    assert(root_);
-
-    Node* root = root_;
-    root->inc_ref();
+    Node* root = get_root();
     bool succ = root->del(key);
     root->dec_ref();
 
@@ -131,10 +273,39 @@ bool BufferTree::get(const Slice& key, Slice& value)
 {
     assert(root_);
 
-    Node* root = root_;
-    root->inc_ref();
-    bool succ = root->get(key, value);
-    root->dec_ref();
+    Node* pinned = NULL;
+    nid_t failed = NID_NIL;
+    bool succ;
+
+    while (true) {
+        Node* root = get_root();
+
+        nid_t missing = NID_NIL;
+        succ = root->get(key, value, NULL, missing);
+        root->dec_ref();
+
+        if (pinned) {
+            pinned->dec_ref();
+            pinned = NULL;
+        }
+
+        if (missing == NID_NIL)
+            break;
+
+        // Read the node with no latch held, then descend again. 
+        // It stays referenced, so it can't be evicted meanwhile.
+        pinned = cache_->get(missing, true);
+
+        // The node may have been merged away meanwhile, so only give up
+        // if the same node is missing again.
+        if (pinned == NULL) {
+            if (missing == failed) {
+                LOG_ERROR << "get node failed, " << Fmt("nid=%zu", missing);
+                return false;
+            }
+            failed = missing;
+        }
+    }
 
     return succ;
 }
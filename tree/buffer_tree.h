@@ -7,6 +7,9 @@
 #include "util/slice.h"
 #include "tree/node.h"
 #include "sys/mutex.h"
+#include "sys/condition.h"
+#include "sys/thread.h"
+#include "sys/thread_pool.h"
 
 #include <map>
 #include <string>
@@ -22,6 +25,9 @@ public:
 
     bool init();
     void grow_up(Node* root);
+
+    // Height of the root node, leaves are at height 0.
+    uint32_t height();
     
     bool put(const Slice& key, const Slice& value);
     bool del(const Slice& key);
@@ -35,20 +41,46 @@ public:
     Node* create_node(nid_t nid);
 
     Node* get_node_by_nid(nid_t nid);
+
+    // Never reads the disk, returns NULL if the node isn't in memory.
+    Node* get_resident_node(nid_t nid);
     void  lock_path(const Slice& key, std::vector<Node*>& path);
 
+    // The referenced root, shrink() may retire the old one anytime.
+    Node* get_root();
+
 private:
     friend class Node;
 
+    // A single thread merges the underfull siblings left by deletes,
+    // every merge_interval seconds.
+    void merge_back();
+    void merge_underfull();
+
+    // Merge the child at the pivot key of the node at height into its
+    // left sibling, the path to it is write locked meanwhile.
+    void merge_at(const std::string& key, uint32_t height);
+
+    // The root with a single child is retired, the child becomes the root.
+    void shrink();
+
+    void unlock_path(std::vector<Node*>& path);
+
     std::string name_;
     Options options_;
     Cache* cache_;
     Table* table_;
     Node* root_; 
+    ThreadPool* pool_;
     nid_t node_count_;
     std::map<nid_t, Node*> node_map_;
     Mutex mutex_;
     Mutex mutex_lock_path_;
+
+    bool alive_;
+    Thread* merger_;
+    Mutex merge_mutex_;
+    CondVar merge_cond_;
 };
 
 } // namespace yodb
@@ -1,31 +1,53 @@
 #include "tree/msg.h"
 
+#include <algorithm>
+
 using namespace yodb;
 
-MsgTable::MsgTable(Comparator* comparator)
-    : list_(Compare(comparator)), 
-      comparator_(comparator), 
-      mutex_(), size_(0)
+namespace {
+
+const size_t kMinChunkSize = 1024;
+const size_t kMaxChunkSize = 64 * 1024;
+
+// Payload bytes of a Msg, see Msg::size().
+size_t payload_size(const Msg& msg)
 {
+    return msg.key().size() + msg.value().size();
 }
 
-MsgTable::~MsgTable()
-{
-    Iterator iter(&list_);
-    iter.seek_to_first();
+class MsgLess {
+public:
+    MsgLess(Comparator* comparator) : comparator_(comparator) {}
 
-    while (iter.valid()) {
-        Msg msg = iter.key();
-        msg.release();
-        iter.next();
+    bool operator()(const Msg& a, const Msg& b) const
+    {
+        return comparator_->compare(a.key(), b.key()) < 0;
     }
+private:
+    Comparator* comparator_;
+};
+
+} // namespace
 
+MsgTable::MsgTable(Comparator* comparator, bool leaf, bool log)
+    : list_(Compare(comparator)), 
+      comparator_(comparator), leaf_(leaf),
+      mutex_(), size_(0),
+      alloc_ptr_(NULL), remaining_(0),
+      payload_usage_(0), garbage_(0),
+      frozen_(false), base_(NULL),
+      logged_(log)
+{
+}
+
+MsgTable::~MsgTable()
+{
     list_.clear();
 }
 
 size_t MsgTable::count()
 {
-    return list_.count();
+    return (frozen_ ? entries_.size() : list_.count()) + log_.size();
 }
 
 size_t MsgTable::size()
@@ -35,7 +57,12 @@ size_t MsgTable::size()
 
 size_t MsgTable::memory_usage()
 {
-    return list_.memory_usage() + sizeof(MsgTable);
+    // an index node is about a Slice, a size_t and two pointers
+    return list_.memory_usage() + payload_usage_ + sizeof(MsgTable) +
+           entries_.capacity() * sizeof(Entry) + 
+           log_.capacity() * sizeof(Msg) + 
+           index_.size() * (sizeof(Slice) + 3 * sizeof(void*)) +
+           index_.bucket_count() * sizeof(void*);
 }
 
 void MsgTable::clear()
@@ -44,44 +71,205 @@ void MsgTable::clear()
 
     list_.clear();
     size_ = 0;
+
+    backings_.clear();
+    alloc_ptr_ = NULL;
+    remaining_ = 0;
+    payload_usage_ = 0;
+    garbage_ = 0;
+
+    std::vector<Entry>().swap(entries_);
+    frozen_ = false;
+    base_ = NULL;
+
+    log_.clear();
+    index_.clear();
+}
+
+Slice MsgTable::copy(const Slice& slice)
+{
+    size_t n = slice.size();
+
+    if (n == 0)
+        return Slice();
+
+    // Chunks grow with the table, large payloads get their own.
+    if (n > remaining_) {
+        size_t chunk_size = payload_usage_;
+
+        if (chunk_size < kMinChunkSize) chunk_size = kMinChunkSize;
+        if (chunk_size > kMaxChunkSize) chunk_size = kMaxChunkSize;
+
+        char* chunk = new char[n > chunk_size / 4 ? n : chunk_size];
+        backings_.push_back(Backing(chunk));
+
+        if (n > chunk_size / 4) {
+            payload_usage_ += n;
+            memcpy(chunk, slice.data(), n);
+            return Slice(chunk, n);
+        }
+
+        payload_usage_ += chunk_size;
+        alloc_ptr_ = chunk;
+        remaining_ = chunk_size;
+    }
+
+    char* result = alloc_ptr_;
+
+    memcpy(result, slice.data(), n);
+    alloc_ptr_ += n;
+    remaining_ -= n;
+
+    return Slice(result, n);
 }
 
 void MsgTable::insert(const Msg& msg)
 {
     assert(mutex_.is_locked_by_this_thread());
 
+    thaw();
+
+    // O(1), the skiplist may still have an older Msg of the key, 
+    // it is replaced by sort_log().
+    if (logged_) {
+        Msg copied(msg.type(), copy(msg.key()), copy(msg.value()));
+        LogIndex::iterator it = index_.find(copied.key());
+
+        if (it != index_.end()) {
+            discard(log_[it->second]);
+            log_[it->second] = copied;
+        } else {
+            index_[copied.key()] = log_.size();
+            log_.push_back(copied);
+        }
+
+        size_ += copied.size();
+        maybe_compact();
+        return;
+    }
+
     Iterator iter(&list_);
-    Msg got;
-    bool release = false;
     iter.seek(msg);
 
     if (iter.valid()) {
-        got = iter.key();
+        Msg got = iter.key();
         
         if (got.key() == msg.key()) {
-            size_ -= got.size();
-            release = true;
+            discard(got);
+
+            if (leaf_ && msg.type() == Del) {
+                list_.erase(got);
+                maybe_compact();
+                return;
+            }
         }
     }
 
-    list_.insert(msg);
-    size_ += msg.size();
+    if (leaf_ && msg.type() == Del)
+        return;
+
+    Msg copied(msg.type(), copy(msg.key()), copy(msg.value()));
 
-    if (release)
-        got.release();
+    list_.insert(copied);
+    size_ += copied.size();
+
+    maybe_compact();
 }
 
-void MsgTable::resize(size_t size)
+void MsgTable::discard(const Msg& msg)
+{
+    size_ -= msg.size();
+    garbage_ += payload_size(msg);
+}
+
+void MsgTable::merge(Iterator& iter, const Slice* limit)
 {
     assert(mutex_.is_locked_by_this_thread());
-    list_.resize(size);
 
-    size_ = 0;
+    thaw();
+    sort_log();
+
+    List::Merger merger(&list_);
+
+    while (iter.valid()) {
+        const Msg& msg = iter.key();
+
+        if (limit && comparator_->compare(msg.key(), *limit) >= 0)
+            break;
+
+        Msg old;
+
+        if (leaf_ && msg.type() == Del) {
+            if (merger.erase(msg, old))
+                discard(old);
+
+            iter.next();
+            continue;
+        }
+
+        Msg copied(msg.type(), copy(msg.key()), copy(msg.value()));
+
+        if (merger.insert(copied, old))
+            discard(old);
+        size_ += copied.size();
+
+        iter.next();
+    }
+
+    maybe_compact();
+}
+
+void MsgTable::split(size_t size, MsgTable* table)
+{
+    assert(mutex_.is_locked_by_this_thread());
+    assert(table->mutex_.is_locked_by_this_thread());
+    assert(table->count() == 0);
+
+    thaw();
+    sort_log();
+    list_.split(size, &table->list_);
+
+    // The moved Msg still point into our payloads.
+    Iterator iter(&table->list_);
+    iter.seek_to_first();
+
+    while (iter.valid()) {
+        const Msg& msg = iter.key();
+
+        discard(msg);
+
+        table->size_ += msg.size();
+        iter.set_key(Msg(msg.type(), table->copy(msg.key()), 
+                         table->copy(msg.value())));
+        iter.next();
+    }
+
+    maybe_compact();
+}
+
+void MsgTable::maybe_compact()
+{
+    if (garbage_ < kMinChunkSize || garbage_ < payload_usage_ / 2)
+        return;
+
+    // The index points into the payloads too.
+    sort_log();
+
+    std::vector<Backing> backings;
+    backings.swap(backings_);
+
+    alloc_ptr_ = NULL;
+    remaining_ = 0;
+    payload_usage_ = 0;
+    garbage_ = 0;
+
     Iterator iter(&list_);
     iter.seek_to_first();
 
     while (iter.valid()) {
-        size_ += iter.key().size(); 
+        const Msg& msg = iter.key();
+
+        iter.set_key(Msg(msg.type(), copy(msg.key()), copy(msg.value())));
         iter.next();
     }
 }
@@ -89,7 +277,41 @@ void MsgTable::resize(size_t size)
 bool MsgTable::find(Slice key, Msg& msg)
 {
     assert(mutex_.is_locked_by_this_thread());
+
+    if (!index_.empty()) {
+        LogIndex::iterator it = index_.find(key);
+
+        if (it != index_.end()) {
+            msg = log_[it->second];
+            return true;
+        }
+    }
     
+    if (frozen_) {
+        size_t left = 0, right = entries_.size();
+
+        while (left < right) {
+            size_t mid = left + (right - left) / 2;
+            const Entry& entry = entries_[mid];
+
+            if (comparator_->compare(Slice(base_ + entry.key_offset, 
+                                           entry.key_size), key) < 0)
+                left = mid + 1;
+            else
+                right = mid;
+        }
+
+        if (left < entries_.size()) {
+            Msg got = entry_msg(entries_[left]);
+
+            if (got.key() == key) {
+                msg = got;
+                return true;
+            }
+        }
+        return false;
+    }
+
     Msg fake(_Nop, key);
     Iterator iter(&list_);
 
@@ -103,7 +325,7 @@ bool MsgTable::find(Slice key, Msg& msg)
     return false;
 }
 
-bool MsgTable::constrcutor(BlockReader& reader)
+bool MsgTable::constrcutor(BlockReader& reader, const Backing& backing)
 {
     assert(reader.ok());
 
@@ -114,17 +336,65 @@ bool MsgTable::constrcutor(BlockReader& reader)
     
     if (count == 0) return true;
 
+    // A leaf is frozen right away, pointing into the node buffer.
+    bool frozen = leaf_ && backing;
+    if (frozen) 
+        entries_.reserve(count);
+
+    // The Msg are stored in order.
+    List::Appender appender(&list_);
+
     for (size_t i = 0; i < count; i++) {
         uint8_t type;
         Slice key, value;
 
-        reader >> type >> key;
-        if (type == Put)
-            reader >> value;
+        reader >> type;
+        reader.read_ref(key);
+        if (reader.ok() && type == Put)
+            reader.read_ref(value);
+
+        if (!reader.ok())
+            break;
+
+        // Files written before may still have them at the leaves.
+        if (leaf_ && type == Del) {
+            if (backing) {
+                payload_usage_ += key.size();
+                garbage_ += key.size();
+            }
+            continue;
+        }
+
+        if (!backing) {
+            key = copy(key);
+            value = copy(value);
+        }
 
         Msg msg((MsgType)type, key, value);
-        list_.insert(msg);
         size_ += msg.size();
+
+        if (backing)
+            payload_usage_ += payload_size(msg);
+
+        if (frozen) {
+            Entry entry;
+
+            entry.key_offset = key.data() - backing.get();
+            entry.key_size = key.size();
+            entry.value_offset = value.size() ? value.data() - backing.get() : 0;
+            entry.value_size = value.size();
+            entries_.push_back(entry);
+        } else {
+            appender.append(msg);
+        }
+    }
+
+    if (backing)
+        backings_.push_back(backing);
+
+    if (frozen) {
+        frozen_ = true;
+        base_ = backing.get();
     }
 
     return reader.ok();
@@ -136,8 +406,20 @@ bool MsgTable::destructor(BlockWriter& writer)
 
     ScopedMutex lock(mutex_);
 
-    uint32_t count = list_.count();
+    sort_log();
+
+    uint32_t count = this->count();
     writer << count;
+
+    if (frozen_) {
+        for (size_t i = 0; i < entries_.size(); i++) {
+            Msg msg = entry_msg(entries_[i]);
+            uint8_t type = Put;
+
+            writer << type << msg.key() << msg.value();
+        }
+        return writer.ok();
+    }
     
     Iterator iter(&list_);
     iter.seek_to_first();
@@ -157,3 +439,95 @@ bool MsgTable::destructor(BlockWriter& writer)
 
     return writer.ok();
 }
+
+void MsgTable::freeze()
+{
+    assert(mutex_.is_locked_by_this_thread());
+    assert(leaf_);
+
+    if (frozen_ || list_.count() == 0)
+        return;
+
+    Iterator iter(&list_);
+    size_t bytes = 0;
+
+    for (iter.seek_to_first(); iter.valid(); iter.next())
+        bytes += payload_size(iter.key());
+
+    char* buffer = new char[bytes + 1];
+    std::vector<Entry> entries;
+    uint32_t offset = 0;
+
+    entries.reserve(list_.count());
+
+    for (iter.seek_to_first(); iter.valid(); iter.next()) {
+        const Msg& msg = iter.key();
+        Entry entry;
+
+        assert(msg.type() == Put);
+
+        entry.key_offset = offset;
+        entry.key_size = msg.key().size();
+        memcpy(buffer + offset, msg.key().data(), entry.key_size);
+        offset += entry.key_size;
+
+        entry.value_offset = offset;
+        entry.value_size = msg.value().size();
+        memcpy(buffer + offset, msg.value().data(), entry.value_size);
+        offset += entry.value_size;
+
+        entries.push_back(entry);
+    }
+
+    list_.clear();
+
+    backings_.clear();
+    backings_.push_back(Backing(buffer));
+    alloc_ptr_ = NULL;
+    remaining_ = 0;
+    payload_usage_ = bytes;
+    garbage_ = 0;
+
+    entries_.swap(entries);
+    base_ = buffer;
+    frozen_ = true;
+}
+
+void MsgTable::thaw()
+{
+    assert(mutex_.is_locked_by_this_thread());
+
+    if (!frozen_)
+        return;
+
+    List::Appender appender(&list_);
+
+    for (size_t i = 0; i < entries_.size(); i++)
+        appender.append(entry_msg(entries_[i]));
+
+    std::vector<Entry>().swap(entries_);
+    frozen_ = false;
+    base_ = NULL;
+}
+
+void MsgTable::sort_log()
+{
+    assert(mutex_.is_locked_by_this_thread());
+
+    if (log_.empty())
+        return;
+
+    std::sort(log_.begin(), log_.end(), MsgLess(comparator_));
+
+    List::Merger merger(&list_);
+
+    for (size_t i = 0; i < log_.size(); i++) {
+        Msg old;
+
+        if (merger.insert(log_[i], old))
+            discard(old);
+    }
+
+    log_.clear();
+    index_.clear();
+}
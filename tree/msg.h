@@ -7,7 +7,10 @@
 #include "sys/mutex.h"
 #include "tree/skiplist.h"
 
+#include <stdint.h>
 #include <vector>
+#include <unordered_map>
+#include <boost/shared_array.hpp>
 
 namespace yodb {
 
@@ -33,13 +36,6 @@ public:
         return size;
     }
 
-    void release()
-    {
-        key_.release();
-        if (value_.size()) 
-            value_.release();
-    }
-
     Slice key()    const { return key_; }
     Slice value()  const { return value_; }
     MsgType type() const { return type_; }
@@ -63,12 +59,49 @@ private:
     Comparator* comparator_;
 };
 
+// FNV-1a over the bytes, keys are equal if their bytes are.
+class SliceHash {
+public:
+    size_t operator()(const Slice& slice) const
+    {
+        const unsigned char* p = (const unsigned char*)slice.data();
+        uint64_t hash = 14695981039346656037ULL;
+
+        for (size_t i = 0; i < slice.size(); i++) {
+            hash ^= p[i];
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+};
+
+// A buffer the payloads of Msg live in: the buffer a node was read 
+// from, or a chunk of a table's arena. It is freed with the last table
+// that holds it.
+typedef boost::shared_array<char> Backing;
+
+// The Msg in a table only point into its backings, insert() copies the
+// key and value in. Overwritten payloads are reclaimed by compaction.
+//
+// Nothing lives below a leaf, so a leaf table keeps no Del: it removes
+// the key it deletes, and is dropped itself.
+//
+// Leaves are read far more than written, so a leaf table may be frozen:
+// its Msg are kept in a sorted array of offsets into a packed buffer,
+// searched by bisection. It is frozen when loaded, pointing into the 
+// node buffer, or by freeze(), and thawed back into the skiplist by 
+// the first change, which costs a linear pass but no copy.
+//
+// An interior table may take single inserts into an append log instead,
+// with a hash index for find() and overwrites. The log is sorted into 
+// the skiplist once, when the table is pushed down or written back.
+
 class MsgTable {
 public:
     typedef SkipList<Msg, Compare> List;
     typedef List::Iterator Iterator;
 
-    MsgTable(Comparator* comparator);
+    MsgTable(Comparator* comparator, bool leaf = false, bool log = false);
     ~MsgTable();
 
     size_t count();
@@ -77,7 +110,7 @@ public:
 
     size_t memory_usage();
 
-    // Clear the Msg, but not delete the memory they allocated.
+    // Clear the Msg and drop their payloads.
     void clear();
 
     // you must lock hold the lock before use it
@@ -85,21 +118,79 @@ public:
 
     void insert(const Msg& msg);
 
-    bool constrcutor(BlockReader& reader);
+    // Merge the sorted Msg from the iterator on, until the first one not 
+    // less than limit, or all of them if there is no limit. The iterator
+    // is left there.
+    void merge(Iterator& iter, const Slice* limit);
+
+    // The Msg point into the backing if there is one, or else are copied.
+    bool constrcutor(BlockReader& reader, const Backing& backing = Backing());
     bool destructor(BlockWriter& writer);
 
-    // resize the msgbuf, release but not delete the truncated Msg
-    void resize(size_t size);
+    // Move the Msg from the size-th on to the empty table,
+    // whose lock you must hold too.
+    void split(size_t size, MsgTable* table);
+
+    // Pack the Msg of a leaf table into a single buffer and 
+    // the sorted array, the skiplist is dropped.
+    void freeze();
 
     void lock()         { mutex_.lock(); }
     void unlock()       { mutex_.unlock(); }
 
-    List* skiplist()    { return &list_; }
+    // The table is thawed and the log sorted first, you must hold the lock.
+    List* skiplist()    { thaw(); sort_log(); return &list_; }
 private:
+    // There are only Put in a frozen table.
+    struct Entry {
+        uint32_t key_offset;
+        uint32_t key_size;
+        uint32_t value_offset;
+        uint32_t value_size;
+    };
+
+    Msg entry_msg(const Entry& entry) const
+    {
+        return Msg(Put, Slice(base_ + entry.key_offset, entry.key_size),
+                        Slice(base_ + entry.value_offset, entry.value_size));
+    }
+
+    // Rebuild the skiplist from the array, the payloads stay.
+    void thaw();
+
+    // Merge the log into the skiplist, it is newer.
+    void sort_log();
+
+    // Copy the slice into the current chunk.
+    Slice copy(const Slice& slice);
+
+    // The Msg was replaced or removed, its payload is garbage now.
+    void discard(const Msg& msg);
+
+    // Copy the live payloads into new chunks if most bytes are garbage.
+    void maybe_compact();
+
     List list_;
     Comparator* comparator_;
+    bool leaf_;
     Mutex mutex_;
     size_t size_;
+
+    std::vector<Backing> backings_;
+    char* alloc_ptr_;
+    size_t remaining_;
+    size_t payload_usage_;  // bytes of the backings we account for
+    size_t garbage_;        // payload bytes no Msg points to
+
+    bool frozen_;
+    const char* base_;      // the backing the entries point into
+    std::vector<Entry> entries_;
+
+    // The log holds a key at most once, the index maps it to its Msg.
+    typedef std::unordered_map<Slice, size_t, SliceHash> LogIndex;
+    bool logged_;
+    std::vector<Msg> log_;
+    LogIndex index_;
 };
 
 } // namespace yodb
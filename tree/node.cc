@@ -1,14 +1,33 @@
 #include "tree/node.h"
 #include "tree/buffer_tree.h"
+#include "sys/thread_pool.h"
+#include "util/crc32c.h"
+
+#include <boost/bind.hpp>
 
 using namespace yodb;
 
+namespace {
+
+// Not a CompressType, the whole node frame starts with one.
+const uint32_t kPartitionedMagic = 0x4e444f50;
+
+// magic, size and crc32c of the header frame
+const size_t kPartitionedPrefix = 12;
+
+const size_t kNodeHeaderSize = 8 + 1 + 4 + 4;
+
+} // namespace
+
 Node::Node(BufferTree* tree, nid_t self)
     : tree_(tree), 
       self_nid_(self), 
+      height_(0),
       refcnt_(0), 
+      unloaded_(0),
       dirty_(false), 
-      flushing_(false)
+      flushing_(false),
+      version_(0)
 {
 }
 
@@ -26,7 +45,7 @@ Node::~Node()
     pivots_.clear();
 }
 
-bool Node::get(const Slice& key, Slice& value, Node* parent)
+bool Node::get(const Slice& key, Slice& value, Node* parent, nid_t& missing)
 {
     read_lock();
 
@@ -35,7 +54,30 @@ bool Node::get(const Slice& key, Slice& value, Node* parent)
     }
 
     size_t index = find_pivot(key);
-    MsgTable* table = pivots_[index].table;
+    MsgTable* table;
+
+    // Read the table of a partial node with no latch held.
+    while ((table = pivot_table(index)) == NULL) {
+        read_unlock();
+
+        bool loaded = load_partitions(std::vector<size_t>(1, index));
+
+        read_lock();
+
+        // We may be merged away meanwhile, the caller descends again.
+        if (pivots_.empty()) {
+            missing = self_nid_;
+            read_unlock();
+            return false;
+        }
+
+        if (!loaded) {
+            read_unlock();
+            return false;
+        }
+
+        index = find_pivot(key);
+    }
 
     table->lock();
 
@@ -59,10 +101,14 @@ bool Node::get(const Slice& key, Slice& value, Node* parent)
         return false;
     }
 
-    Node* node = tree_->get_node_by_nid(pivots_[index].child_nid);
-    assert(node);
+    Node* node = tree_->get_resident_node(pivots_[index].child_nid);
+    if (node == NULL) {
+        missing = pivots_[index].child_nid;
+        read_unlock();
+        return false;
+    }
 
-    bool exists = node->get(key, value, this);
+    bool exists = node->get(key, value, this, missing);
     node->dec_ref();
 
     return exists;
@@ -70,12 +116,12 @@ bool Node::get(const Slice& key, Slice& value, Node* parent)
 
 bool Node::put(const Slice& key, const Slice& value)
 {
-    return write(Msg(Put, key.clone(), value.clone()));
+    return write(Msg(Put, key, value));
 }
 
 bool Node::del(const Slice& key)
 {
-    return write(Msg(Del, key.clone()));
+    return write(Msg(Del, key));
 }
     
 bool Node::write(const Msg& msg)
@@ -84,10 +130,15 @@ bool Node::write(const Msg& msg)
 
     optional_lock();
 
-    if (tree_->root_->nid() != self_nid_) {
+    Node* root = tree_->get_root();
+
+    if (root != this) {
         optional_unlock();
-        return tree_->root_->write(msg);
+        bool succ = root->write(msg);
+        root->dec_ref();
+        return succ;
     }
+    root->dec_ref();
 
     insert_msg(find_pivot(msg.key()), msg);
     set_dirty(true);
@@ -96,25 +147,58 @@ bool Node::write(const Msg& msg)
     return true;
 }
 
-void Node::maybe_push_down_or_split()
+void Node::maybe_push_down_or_split(bool prefetched)
 {
-    int index = -1;
+    std::vector<size_t> full;
 
     for (size_t i = 0; i < pivots_.size(); i++) {
         if (pivots_[i].table->count() > 
             tree_->options_.max_node_msg_count) {
-            index = i; break;
+            full.push_back(i);
         }
     }
 
-    if (index < 0) {
+    if (full.empty()) {
         optional_unlock();
         return;
     }
 
-    if (pivots_[index].child_nid != NID_NIL) {
+    size_t index = full[0];
+
+    // Workers cascade on their own, they never wait for the pool.
+    bool batch = full.size() > 1 && tree_->pool_ && !ThreadPool::in_worker();
+
+    // Never wait for the disk with our latch held: read the children
+    // first, then look at the pivots again, they may change meanwhile.
+    if (!prefetched && pivots_[index].child_nid != NID_NIL) {
+        std::vector<nid_t> nids;
+
+        for (size_t i = 0; i < (batch ? full.size() : 1); i++)
+            nids.push_back(pivots_[full[i]].child_nid);
+
+        optional_unlock();
+        prefetch_children(nids);
+        optional_lock();
+
+        maybe_push_down_or_split(true);
+        return;
+    }
+
+    if (batch && pivots_[index].child_nid != NID_NIL) {
+        // The messages stay in our buffer if a child is unreadable.
+        if (!push_down_children(full))
+            return;
+    } else if (pivots_[index].child_nid != NID_NIL) {
         MsgTable* table = pivots_[index].table;
         Node* node = tree_->get_node_by_nid(pivots_[index].child_nid);
+
+        // The messages stay in our buffer if the child is unreadable.
+        if (node == NULL) {
+            LOG_ERROR << "get child failed, " << Fmt("nid=%zu", pivots_[index].child_nid);
+            optional_unlock();
+            return;
+        }
+
         node->push_down(table, this);
         node->dec_ref();
     } else {
@@ -125,6 +209,99 @@ void Node::maybe_push_down_or_split()
     maybe_push_down_or_split();
 }
 
+namespace yodb {
+
+// The children cascading at once, the parent waits for all of them.
+class PushDownBatch : boost::noncopyable {
+public:
+    explicit PushDownBatch(size_t count)
+        : running_(count), mutex_(), cond_(mutex_) {}
+
+    void done()
+    {
+        ScopedMutex lock(mutex_);
+
+        if (--running_ == 0)
+            cond_.notify_all();
+    }
+
+    void wait()
+    {
+        ScopedMutex lock(mutex_);
+
+        while (running_)
+            cond_.wait();
+    }
+
+private:
+    size_t running_;
+    Mutex mutex_;
+    CondVar cond_;
+};
+
+} // namespace yodb
+
+bool Node::push_down_children(const std::vector<size_t>& indexes)
+{
+    assert(!is_leaf_);
+
+    // The merges are done here, so no worker ever waits for a lock 
+    // held on behalf of a task still in the queue.
+    std::vector<Node*> children;
+    bool succ = true;
+
+    for (size_t i = 0; i < indexes.size(); i++) {
+        Pivot& pivot = pivots_[indexes[i]];
+        Node* node = tree_->get_node_by_nid(pivot.child_nid);
+
+        if (node == NULL) {
+            LOG_ERROR << "get child failed, " << Fmt("nid=%zu", pivot.child_nid);
+            succ = false;
+            continue;
+        }
+
+        node->optional_lock();
+        node->push_down_locked(pivot.table, this);
+        node->optional_unlock();
+
+        children.push_back(node);
+    }
+
+    optional_unlock();
+
+    PushDownBatch batch(children.size());
+
+    for (size_t i = 0; i < children.size(); i++)
+        tree_->pool_->run(boost::bind(&Node::cascade, children[i], &batch));
+
+    batch.wait();
+    return succ;
+}
+
+void Node::prefetch_children(const std::vector<nid_t>& nids)
+{
+    // Children which aren't resident are read at the same time.
+    tree_->cache_->prefetch(nids);
+
+    for (size_t i = 0; i < nids.size(); i++) {
+        Node* node = tree_->get_resident_node(nids[i]);
+
+        if (node) {
+            node->load_partitions();
+            node->dec_ref();
+        }
+    }
+}
+
+void Node::cascade(PushDownBatch* batch)
+{
+    optional_lock();
+    maybe_push_down_or_split();
+    dec_ref();
+
+    batch->done();
+}
+
 void Node::create_first_pivot()
 {
     write_lock();
@@ -172,7 +349,7 @@ void Node::split_table(MsgTable* table)
     }
 
     MsgTable* table0 = table;
-    MsgTable* table1 = new MsgTable(tree_->options_.comparator);
+    MsgTable* table1 = new_table();
 
     table0->lock();
 
@@ -180,22 +357,21 @@ void Node::split_table(MsgTable* table)
 
     iter.seek_to_first();
     assert(iter.valid());
-    Msg msg = iter.key();
 
-    iter.seek_to_middle();
-    assert(iter.valid());
-    Msg middle = iter.key();
+    // The payloads may be compacted by split(), keep copies of the keys.
+    std::string first_key = iter.key().key().to_string();
 
     table1->lock();
-    while (iter.valid()) {
-        table1->insert(iter.key());
-        iter.next();
-    }
 
     size_t sz = table0->size();
-    table0->resize(table0->count() / 2);
+    table0->split(table0->count() / 2, table1);
+
+    MsgTable::Iterator middle(table1->skiplist());
 
-    add_pivot(NID_NIL, table1, middle.key().clone());
+    middle.seek_to_first();
+    assert(middle.valid());
+
+    add_pivot(NID_NIL, table1, middle.key().key().clone());
 
     assert(table0->size() + table1->size() >= sz);
 
@@ -206,7 +382,7 @@ void Node::split_table(MsgTable* table)
     write_unlock();
 
     std::vector<Node*> locked_path;
-    tree_->lock_path(msg.key(), locked_path);
+    tree_->lock_path(first_key, locked_path);
      
     if (!locked_path.empty()) {
         Node* node = locked_path.back();
@@ -235,6 +411,7 @@ void Node::try_split_node(std::vector<Node*>& path)
 
     Node* node = tree_->create_node();
     node->is_leaf_ = is_leaf_;
+    node->height_ = height_;
     
     Container::iterator first = pivots_.begin() + middle;
     Container::iterator last  = pivots_.end();
@@ -251,6 +428,7 @@ void Node::try_split_node(std::vector<Node*>& path)
     if (path.empty()) {
         Node* root = tree_->create_node();
         root->is_leaf_ = false;
+        root->height_ = height_ + 1;
 
         root->add_pivot(nid(), NULL, Slice());
         root->add_pivot(node->nid(), NULL, middle_key.clone());
@@ -267,6 +445,22 @@ void Node::try_split_node(std::vector<Node*>& path)
     dec_ref();
 }
 
+MsgTable* Node::pivot_table(size_t index)
+{
+    ScopedMutex lock(pivots_mutex_);
+
+    pivots_[index].used = true;
+    return pivots_[index].table;
+}
+
+MsgTable* Node::new_table()
+{
+    const Options& opts = tree_->options_;
+
+    return new MsgTable(opts.comparator, is_leaf_, 
+                        !is_leaf_ && opts.interior_append_log);
+}
+
 void Node::add_pivot(nid_t child, MsgTable* table, Slice key)
 {
     ScopedMutex lock(pivots_mutex_);
@@ -275,13 +469,13 @@ void Node::add_pivot(nid_t child, MsgTable* table, Slice key)
         assert(table == NULL);
         assert(pivots_.size() == 0);
 
-        table = new MsgTable(tree_->options_.comparator);
+        table = new_table();
         pivots_.push_back(Pivot(child, table, key));
     } else {
         assert(pivots_.size());
 
         if (table == NULL) {
-            table = new MsgTable(tree_->options_.comparator);
+            table = new_table();
         }
 
         size_t idx = find_pivot(key);
@@ -300,12 +494,210 @@ void Node::lock_path(const Slice& key, std::vector<Node*>& path)
     if (pivots_[index].child_nid != NID_NIL) {
         Node* node = tree_->get_node_by_nid(pivots_[index].child_nid);
 
+        // Stop here, the path is still consistent for try_split_node().
+        if (node == NULL) {
+            LOG_ERROR << "get child failed, " << Fmt("nid=%zu", pivots_[index].child_nid);
+            return;
+        }
+
         node->write_lock();
         node->push_down_locked(pivots_[index].table, this);
         node->lock_path(key, path);
     }
 }
 
+size_t Node::pivot_count()
+{
+    ScopedMutex lock(pivots_mutex_);
+    return pivots_.size();
+}
+
+void Node::collect_merges(MergeList& merges)
+{
+    std::vector<Node*> children;
+
+    read_lock();
+
+    if (is_leaf_) {
+        read_unlock();
+        return;
+    }
+
+    // Children are locked one at a time, merge_child() locks a child
+    // and then its left sibling.
+    Node* last = NULL;
+    size_t last_weight = 0;
+    bool last_underfull = false;
+
+    for (size_t i = 0; i < pivots_.size(); i++) {
+        Node* node = tree_->get_resident_node(pivots_[i].child_nid);
+
+        if (node == NULL) {
+            last = NULL;
+            continue;
+        }
+
+        node->read_lock();
+        size_t weight = node->merge_weight();
+        size_t limit = node->merge_limit();
+        bool underfull = node->underfull();
+        node->read_unlock();
+
+        if (last && (last_underfull || underfull) && 
+            last_weight + weight <= limit) {
+            merges.push_back(std::make_pair(
+                pivots_[i].left_most_key.to_string(), height_));
+        }
+
+        last = node;
+        last_weight = weight;
+        last_underfull = underfull;
+        children.push_back(node);
+    }
+
+    read_unlock();
+
+    for (size_t i = 0; i < children.size(); i++) {
+        children[i]->collect_merges(merges);
+        children[i]->dec_ref();
+    }
+}
+
+bool Node::merge_child(const Slice& key, Node* right)
+{
+    assert(!is_leaf_);
+
+    // Things may change since the merge was collected.
+    size_t index = find_pivot(key);
+
+    if (index == 0 || pivots_[index].left_most_key != key ||
+        pivots_[index].child_nid != right->nid()) 
+        return false;
+
+    Node* left = tree_->get_resident_node(pivots_[index - 1].child_nid);
+    if (left == NULL) 
+        return false;
+
+    if (!left->load_partitions()) {
+        left->dec_ref();
+        return false;
+    }
+
+    left->write_lock();
+
+    if (left->is_leaf_ != right->is_leaf_ ||
+        left->merge_weight() + right->merge_weight() > left->merge_limit() ||
+        !(left->underfull() || right->underfull())) {
+        left->write_unlock();
+        left->dec_ref();
+        return false;
+    }
+
+    // lock_path() has pushed our buffer of right down.
+    Pivot& pivot = pivots_[index];
+    assert(pivot.table->count() == 0);
+
+    {
+        ScopedMutex lock_left(left->pivots_mutex_);
+        ScopedMutex lock_right(right->pivots_mutex_);
+
+        Container& moved = right->pivots_;
+
+        if (moved[0].left_most_key.size() == 0)
+            moved[0].left_most_key = key.clone();
+
+        left->pivots_.insert(left->pivots_.end(), moved.begin(), moved.end());
+        moved.clear();
+    }
+
+    if (left->is_leaf_)
+        left->merge_tables();
+
+    {
+        ScopedMutex lock(pivots_mutex_);
+
+        pivot.left_most_key.release();
+        delete pivot.table;
+        pivots_.erase(pivots_.begin() + index);
+    }
+
+    left->set_dirty(true);
+    set_dirty(true);
+
+    left->write_unlock();
+    left->dec_ref();
+    return true;
+}
+
+size_t Node::merge_weight()
+{
+    if (!is_leaf_)
+        return pivots_.size();
+
+    ScopedMutex lock(pivots_mutex_);
+
+    size_t count = 0;
+    for (size_t i = 0; i < pivots_.size(); i++) {
+        MsgTable* table = pivots_[i].table;
+        count += table ? table->count() : pivots_[i].part.count;
+    }
+
+    return count;
+}
+
+size_t Node::merge_limit()
+{
+    const Options& opts = tree_->options_;
+
+    if (!is_leaf_)
+        return opts.max_node_child_number;
+
+    // merge_tables() then leaves no two adjacent tables which would fit
+    // in one, so there are at most max_node_child_number of them.
+    return opts.max_node_msg_count / 2 * (opts.max_node_child_number - 1) / 2;
+}
+
+bool Node::underfull()
+{
+    // Interior nodes are a quarter full, so two half full ones
+    // aren't merged only to split again.
+    return merge_weight() * (is_leaf_ ? 2 : 4) < merge_limit();
+}
+
+void Node::merge_tables()
+{
+    assert(is_leaf_);
+
+    size_t limit = tree_->options_.max_node_msg_count / 2;
+    size_t i = 0;
+
+    while (i + 1 < pivots_.size()) {
+        MsgTable* table0 = pivots_[i].table;
+        MsgTable* table1 = pivots_[i + 1].table;
+
+        if (table0->count() + table1->count() > limit) {
+            i++;
+            continue;
+        }
+
+        table0->lock();
+        table1->lock();
+
+        MsgTable::Iterator iter(table1->skiplist());
+        iter.seek_to_first();
+        table0->merge(iter, NULL);
+
+        table1->unlock();
+        table0->unlock();
+
+        ScopedMutex lock(pivots_mutex_);
+
+        pivots_[i + 1].left_most_key.release();
+        delete table1;
+        pivots_.erase(pivots_.begin() + i + 1);
+    }
+}
+
 void Node::push_down_locked(MsgTable* table, Node* parent)
 {
     table->lock();
@@ -315,34 +707,22 @@ void Node::push_down_locked(MsgTable* table, Node* parent)
         return;
     }
 
-    size_t idx = 1;
-    size_t i = 0, j = 0;
-    MsgTable::Iterator slow(table->skiplist());
-    MsgTable::Iterator fast(table->skiplist());
+    // The table is sorted, each pivot takes a run of it in one merge.
+    MsgTable::Iterator iter(table->skiplist());
+    iter.seek_to_first();
 
-    slow.seek_to_first();
-    fast.seek_to_first();
+    for (size_t i = 0; i < pivots_.size() && iter.valid(); i++) {
+        const Slice* limit = NULL;
+        if (i + 1 < pivots_.size())
+            limit = &pivots_[i + 1].left_most_key;
 
-    Comparator* cmp = tree_->options_.comparator;
-
-    while (fast.valid() && idx < pivots_.size()) {
-        if (cmp->compare(fast.key().key(), pivots_[idx].left_most_key) < 0) {
-            j++;
-            fast.next();
-        } else {
-            while (i != j) {
-                insert_msg(idx - 1, slow.key());
-                i++;
-                slow.next();
-            }
-            idx++;
-        }
-    }
+        MsgTable* child = pivots_[i].table;
 
-    while (slow.valid()) {
-        insert_msg(idx - 1, slow.key());
-        slow.next();
+        child->lock();
+        child->merge(iter, limit);
+        child->unlock();
     }
+    assert(!iter.valid());
 
     set_dirty(true);
     parent->set_dirty(true);
@@ -365,18 +745,36 @@ size_t Node::size()
 
     size_t usage = sizeof(Node);
 
-    for (size_t i = 0; i < pivots_.size(); i++)
-        usage += pivots_[i].table->memory_usage() + pivots_[i].table->size();
+    for (size_t i = 0; i < pivots_.size(); i++) {
+        if (pivots_[i].table)
+            usage += pivots_[i].table->memory_usage();
+    }
 
     return usage + pivots_.size() * sizeof(Pivot);
 }
 
+void Node::freeze()
+{
+    if (!is_leaf_)
+        return;
+
+    for (size_t i = 0; i < pivots_.size(); i++) {
+        MsgTable* table = pivots_[i].table;
+        if (table == NULL) continue;
+
+        table->lock();
+        table->freeze();
+        table->unlock();
+    }
+}
+
 size_t Node::write_back_size()
 {
     size_t size = 0;
 
     size += 8;      // self_nid_
     size += 1;      // is_leaf
+    size += 4;      // height
     size += 4;      // number of pivots
 
     for (size_t i = 0; i < pivots_.size(); i++) {
@@ -388,49 +786,396 @@ size_t Node::write_back_size()
     return size;
 }
 
-bool Node::constrcutor(BlockReader& reader)
+bool Node::constrcutor(BlockReader& reader, const Backing& backing)
 {
-    reader >> self_nid_ >> is_leaf_;
+    reader >> self_nid_ >> is_leaf_ >> height_;
 
     uint32_t pivots = 0;
     reader >> pivots;
 
-    assert(reader.ok());
-    assert(pivots > 0);
+    if (!reader.ok() || pivots == 0)
+        return false;
 
-    for (size_t i = 0; i < pivots; i++) {
+    for (size_t i = 0; i < pivots && reader.ok(); i++) {
         nid_t child;
-        MsgTable* table = new MsgTable(tree_->options_.comparator);
+        MsgTable* table = new_table();
         Slice left_most_key;
 
         reader >> child >> left_most_key;
-        table->constrcutor(reader);
+        table->constrcutor(reader, backing);
 
         pivots_.push_back(Pivot(child, table, left_most_key));
     }
-    set_dirty(true);
 
     return reader.ok();
 }
 
 bool Node::destructor(BlockWriter& writer)
 {
-    writer << self_nid_ << is_leaf_;
+    writer << self_nid_ << is_leaf_ << height_;
 
+    // A node merged away has no pivot, it is never read back.
     uint32_t pivots = pivots_.size();
-    assert(pivots > 0);
 
     writer << pivots;
 
-    for (size_t i = 0; i < pivots; i++) {
+    for (size_t i = 0; i < pivots && writer.ok(); i++) {
         writer << pivots_[i].child_nid
                << pivots_[i].left_most_key;
-        pivots_[i].table->destructor(writer);
+
+        if (writer.ok())
+            pivots_[i].table->destructor(writer);
     }
 
     return writer.ok();
 }
 
+bool Node::partitioned(const char* data, size_t size, size_t& header_size)
+{
+    if (size < kPartitionedPrefix)
+        return false;
+
+    Block block(Slice(data, kPartitionedPrefix));
+    BlockReader reader(block);
+    uint32_t magic, frame_size;
+
+    reader >> magic >> frame_size;
+    if (!reader.ok() || magic != kPartitionedMagic)
+        return false;
+
+    header_size = kPartitionedPrefix + frame_size;
+    return true;
+}
+
+size_t Node::encode_size()
+{
+    size_t header = kNodeHeaderSize;
+    size_t tables = 0;
+
+    for (size_t i = 0; i < pivots_.size(); i++) {
+        header += 8 + 4 + pivots_[i].left_most_key.size() + 16;
+        tables += max_compressed_size(pivots_[i].table->size());
+    }
+
+    return kPartitionedPrefix + max_compressed_size(header) + tables;
+}
+
+size_t Node::encode(CompressType type, char* dst, size_t room)
+{
+    size_t header_size = kNodeHeaderSize;
+
+    for (size_t i = 0; i < pivots_.size(); i++) 
+        header_size += 8 + 4 + pivots_[i].left_most_key.size() + 16;
+
+    // The tables are framed past the room of the header first, and
+    // moved down behind it once its size is known. Their offsets 
+    // are kept from the end of the header.
+    char* tables = dst + kPartitionedPrefix + max_compressed_size(header_size);
+    char* end = dst + room;
+    std::vector<Partition> parts(pivots_.size());
+    Slice raw;
+    size_t pos = 0;
+
+    for (size_t i = 0; i < pivots_.size(); i++) {
+        MsgTable* table = pivots_[i].table;
+        size_t size = table->size();
+
+        // Writers may insert into the tables of an interior node,
+        // which is only read locked.
+        if (tables + pos + max_compressed_size(size) > end) {
+            if (raw.size()) raw.release();
+            return 0;
+        }
+
+        if (raw.size() < size) {
+            if (raw.size()) raw.release();
+            raw = Slice::alloc(size);
+        }
+
+        Block block(raw, 0, size);
+        BlockWriter writer(block);
+
+        if (!table->destructor(writer)) {
+            if (raw.size()) raw.release();
+            return 0;
+        }
+
+        parts[i].offset = pos;
+        parts[i].size = compress(type, raw.data(), size, tables + pos);
+        parts[i].crc = crc32c::value(tables + pos, parts[i].size);
+        parts[i].count = table->count();
+        pos += parts[i].size;
+    }
+
+    if (raw.size()) raw.release();
+
+    raw = Slice::alloc(header_size);
+    Block block(raw, 0, header_size);
+    BlockWriter writer(block);
+
+    writer << self_nid_ << is_leaf_ << height_ << (uint32_t)pivots_.size();
+
+    for (size_t i = 0; i < pivots_.size(); i++) {
+        writer << pivots_[i].child_nid << pivots_[i].left_most_key 
+               << parts[i].offset << parts[i].size 
+               << parts[i].crc << parts[i].count;
+    }
+    assert(writer.ok());
+
+    char* frame = dst + kPartitionedPrefix;
+    uint32_t frame_size = compress(type, raw.data(), header_size, frame);
+    raw.release();
+
+    Block prefix(Slice(dst, kPartitionedPrefix));
+    BlockWriter prefix_writer(prefix);
+
+    prefix_writer << kPartitionedMagic << frame_size 
+                  << crc32c::value(frame, frame_size);
+
+    memmove(frame + frame_size, tables, pos);
+
+    // Where the tables are on disk once the node is written.
+    {
+        ScopedMutex lock(pivots_mutex_);
+
+        for (size_t i = 0; i < pivots_.size(); i++) {
+            parts[i].offset += kPartitionedPrefix + frame_size;
+            pivots_[i].part = parts[i];
+        }
+    }
+
+    return kPartitionedPrefix + frame_size + pos;
+}
+
+bool Node::decode(const char* data, size_t size, bool partial)
+{
+    size_t header_size;
+    if (!partitioned(data, size, header_size) || header_size > size)
+        return false;
+
+    Block prefix(Slice(data, kPartitionedPrefix));
+    BlockReader prefix_reader(prefix);
+    uint32_t magic, frame_size, crc;
+
+    prefix_reader >> magic >> frame_size >> crc;
+
+    const char* frame = data + kPartitionedPrefix;
+
+    if (crc32c::value(frame, frame_size) != crc) {
+        LOG_ERROR << "bad node header crc";
+        return false;
+    }
+
+    CompressType type;
+    size_t raw_size;
+
+    if (!compress_header(frame, frame_size, type, raw_size) || raw_size == 0)
+        return false;
+
+    Slice raw = Slice::alloc(raw_size);
+
+    if (!uncompress(frame, frame_size, (char*)raw.data())) {
+        raw.release();
+        return false;
+    }
+
+    Block block(raw, 0, raw_size);
+    BlockReader reader(block);
+    uint32_t pivots = 0;
+
+    reader >> self_nid_ >> is_leaf_ >> height_ >> pivots;
+
+    for (size_t i = 0; i < pivots && reader.ok(); i++) {
+        Pivot pivot(NID_NIL, NULL);
+        Partition& part = pivot.part;
+
+        reader >> pivot.child_nid >> pivot.left_most_key
+               >> part.offset >> part.size >> part.crc >> part.count;
+
+        part.offset += header_size;
+        pivots_.push_back(pivot);
+    }
+
+    raw.release();
+
+    if (!reader.ok() || pivots == 0)
+        return false;
+
+    for (size_t i = 0; i < pivots_.size(); i++) {
+        Pivot& pivot = pivots_[i];
+
+        if (partial) {
+            unloaded_++;
+            continue;
+        }
+
+        if (pivot.part.offset + pivot.part.size > size)
+            return false;
+
+        pivot.table = decode_table(data + pivot.part.offset, pivot.part);
+        if (pivot.table == NULL) 
+            return false;
+    }
+
+    return true;
+}
+
+MsgTable* Node::decode_table(const char* frame, const Partition& part)
+{
+    if (crc32c::value(frame, part.size) != part.crc) {
+        LOG_ERROR << "bad partition crc, " << Fmt("nid=%zu", self_nid_);
+        return NULL;
+    }
+
+    CompressType type;
+    size_t size;
+
+    if (!compress_header(frame, part.size, type, size))
+        return NULL;
+
+    // The table points into the backing, like a whole node's.
+    Slice raw = Slice::alloc(size ? size : 1);
+    Backing backing((char*)raw.data());
+
+    if (!uncompress(frame, part.size, (char*)raw.data()))
+        return NULL;
+
+    Block block(raw, 0, size);
+    BlockReader reader(block);
+    MsgTable* table = new_table();
+
+    if (!table->constrcutor(reader, backing) || !reader.ok()) {
+        delete table;
+        return NULL;
+    }
+
+    return table;
+}
+
+bool Node::partial()
+{
+    ScopedMutex lock(pivots_mutex_);
+    return unloaded_ > 0;
+}
+
+bool Node::load_partitions()
+{
+    std::vector<size_t> indexes;
+
+    {
+        ScopedMutex lock(pivots_mutex_);
+
+        if (unloaded_ == 0)
+            return true;
+
+        for (size_t i = 0; i < pivots_.size(); i++)
+            indexes.push_back(i);
+    }
+
+    return load_partitions(indexes);
+}
+
+size_t Node::evict_tables(std::vector<MsgTable*>& tables)
+{
+    ScopedMutex lock(pivots_mutex_);
+
+    size_t usage = 0;
+
+    for (size_t i = 0; i < pivots_.size(); i++) {
+        Pivot& pivot = pivots_[i];
+        MsgTable* table = pivot.table;
+
+        // Tables are only known in our block once we are written.
+        if (table == NULL || pivot.part.size == 0 || table->count() == 0)
+            continue;
+
+        if (pivot.used) {
+            pivot.used = false;
+            continue;
+        }
+
+        usage += table->memory_usage();
+        tables.push_back(table);
+        pivot.table = NULL;
+        unloaded_++;
+    }
+
+    return usage;
+}
+
+bool Node::load_partitions(const std::vector<size_t>& indexes)
+{
+    std::vector<Partition> parts;
+
+    {
+        ScopedMutex lock(pivots_mutex_);
+
+        for (size_t i = 0; i < indexes.size(); i++) {
+            size_t index = indexes[i];
+
+            if (index < pivots_.size() && pivots_[index].table == NULL)
+                parts.push_back(pivots_[index].part);
+        }
+    }
+
+    if (parts.empty()) 
+        return true;
+
+    // The partitions are read at once, they are mostly adjacent.
+    uint32_t begin = parts[0].offset;
+    uint32_t end = parts[0].offset + parts[0].size;
+
+    for (size_t i = 1; i < parts.size(); i++) {
+        begin = std::min(begin, parts[i].offset);
+        end = std::max(end, parts[i].offset + parts[i].size);
+    }
+
+    Table* table = tree_->table_;
+    Block* block = table->read(self_nid_, begin, end - begin);
+
+    if (block == NULL || block->size() != end - begin) {
+        LOG_ERROR << "read partitions error, " << Fmt("nid=%zu", self_nid_);
+        if (block) {
+            table->self_dealloc(block->buffer());
+            delete block;
+        }
+        return false;
+    }
+
+    std::vector<MsgTable*> tables;
+    bool succ = true;
+
+    for (size_t i = 0; i < parts.size(); i++) {
+        MsgTable* t = decode_table(block->data() + parts[i].offset - begin, parts[i]);
+        if (t == NULL) succ = false;
+        tables.push_back(t);
+    }
+
+    table->self_dealloc(block->buffer());
+    delete block;
+
+    // Someone else may have read them meanwhile.
+    ScopedMutex lock(pivots_mutex_);
+
+    for (size_t i = 0; i < tables.size(); i++) {
+        bool used = false;
+
+        for (size_t j = 0; tables[i] && j < pivots_.size(); j++) {
+            if (pivots_[j].table == NULL && pivots_[j].part == parts[i]) {
+                pivots_[j].table = tables[i];
+                unloaded_--;
+                used = true;
+                break;
+            }
+        }
+
+        if (!used) 
+            delete tables[i];
+    }
+
+    return succ;
+}
+
 nid_t Node::nid() 
 {
     ScopedMutex lock(mutex_);
@@ -449,6 +1194,18 @@ void Node::set_leaf(bool leaf)
     is_leaf_ = leaf;
 }
 
+uint32_t Node::height()
+{
+    ScopedMutex lock(mutex_);
+    return height_;
+}
+
+void Node::set_height(uint32_t height)
+{
+    ScopedMutex lock(mutex_);
+    height_ = height;
+}
+
 void Node::set_dirty(bool dirty)
 {
     ScopedMutex lock(mutex_);
@@ -456,9 +1213,26 @@ void Node::set_dirty(bool dirty)
     if (!dirty_ && dirty) 
         first_write_timestamp_ = Timestamp::now();
 
+    if (dirty)
+        version_++;
+
     dirty_ = dirty;
 }
 
+uint64_t Node::version()
+{
+    ScopedMutex lock(mutex_);
+    return version_;
+}
+
+void Node::set_clean(uint64_t version)
+{
+    ScopedMutex lock(mutex_);
+
+    if (version_ == version)
+        dirty_ = false;
+}
+
 bool Node::dirty() 
 {
     ScopedMutex lock(mutex_);
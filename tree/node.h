@@ -7,8 +7,10 @@
 #include "util/slice.h"
 #include "util/block.h"
 #include "util/logger.h"
+#include "util/compress.h"
 
 #include <stdint.h>
+#include <string>
 #include <vector>
 
 namespace yodb {
@@ -18,16 +20,36 @@ typedef uint64_t nid_t;
 #define NID_NIL     ((nid_t)0)
 
 class BufferTree;
+class PushDownBatch;
+
+// Where the table of a pivot is framed in the partitioned node block.
+struct Partition {
+    Partition() : offset(0), size(0), crc(0), count(0) {}
+
+    bool operator==(const Partition& other) const
+    {
+        return offset == other.offset && size == other.size && crc == other.crc;
+    }
+
+    uint32_t offset;
+    uint32_t size;
+    uint32_t crc;       // crc32c of the frame
+    uint32_t count;     // messages of the table
+};
 
 class Pivot {
 public:
-    Pivot() {}
+    Pivot() : table(NULL), child_nid(NID_NIL), used(false) {}
     Pivot(nid_t child, MsgTable* mbuf, Slice key = Slice())
-        : table(mbuf), child_nid(child), left_most_key(key) {}
+        : table(mbuf), child_nid(child), left_most_key(key), used(false) {}
 
+    // NULL if the table isn't read from the partition yet,
+    // or it was evicted.
     MsgTable* table;
     nid_t child_nid;
     Slice left_most_key;
+    Partition part;
+    bool used;          // looked up since the last eviction pass
 };
 
 class Node {
@@ -37,7 +59,11 @@ public:
 
     void create_first_pivot();
 
-    bool get(const Slice& key, Slice& value, Node* parent = NULL);
+    // Never waits for the disk with a latch held: if the child isn't in
+    // memory, it returns false with every latch released and the nid of
+    // the child in missing, the caller reads it and descends again.
+    // missing is our nid if we were merged away while our table was read.
+    bool get(const Slice& key, Slice& value, Node* parent, nid_t& missing);
 
     bool put(const Slice& key, const Slice& value);
 
@@ -52,6 +78,10 @@ public:
     void set_nid(nid_t nid); 
     void set_leaf(bool leaf);
 
+    // Leaves are at height 0, the root has the largest height.
+    uint32_t height();
+    void set_height(uint32_t height);
+
     void read_lock()        { rwlock_.read_lock(); }
     void read_unlock()      { rwlock_.read_unlock(); }
 
@@ -64,6 +94,12 @@ public:
     void set_dirty(bool modified);
     bool dirty();
 
+    // Every modification bumps the version, write back serializes the 
+    // node under the read lock and only marks it clean if nothing 
+    // changed since the version it started with.
+    uint64_t version();
+    void set_clean(uint64_t version);
+
     void set_flushing(bool flushing);
     bool flushing();
 
@@ -74,11 +110,59 @@ public:
     Timestamp get_first_write_timestamp();
     Timestamp get_last_used_timestamp();
 
-    bool constrcutor(BlockReader& reader);
+    // The tables of a leaf which is written back are frozen, see 
+    // MsgTable::freeze(), we are read locked.
+    void freeze();
+
+    // The tables point into the backing, see MsgTable::constrcutor().
+    bool constrcutor(BlockReader& reader, const Backing& backing = Backing());
     bool destructor(BlockWriter& writer);
 
+    // The partitioned format: a header with the pivots and the partition
+    // of each table, then every table framed on its own, so a lookup
+    // reads the header and only the table it needs. Returns whether the
+    // data is in this format, and the bytes the header takes then.
+    static bool partitioned(const char* data, size_t size, size_t& header_size);
+
+    // Room to encode() the node into.
+    size_t encode_size();
+
+    // dst has room bytes, encode_size() when it was taken. Returns the
+    // framed size, zero if a table grew meanwhile and it doesn't fit.
+    size_t encode(CompressType type, char* dst, size_t room);
+
+    // The data holds the header only if partial is set, the tables
+    // are left to load_partitions() then.
+    bool decode(const char* data, size_t size, bool partial);
+
+    // A partial node has pivots whose table isn't read yet. Only readers
+    // see a partial node, writers get it with every table read.
+    bool partial();
+
+    // Read the tables we lack, no latch held.
+    bool load_partitions();
+
+    // Detach the tables which weren't looked up since the last pass and
+    // can be read back from our block, the caller deletes them. Nobody
+    // may hold us: the cache does it with no reference to a clean node
+    // which isn't being written. Returns the memory they use.
+    size_t evict_tables(std::vector<MsgTable*>& tables);
+
     void lock_path(const Slice& key, std::vector<Node*>& path);
 
+    size_t pivot_count();
+
+    // Collect the pivot keys, with the height of their parent, of the
+    // resident children which may be merged into their left sibling,
+    // through the resident part of the tree below us.
+    typedef std::vector<std::pair<std::string, uint32_t> > MergeList;
+    void collect_merges(MergeList& merges);
+
+    // Merge the child right into its left sibling, key is our pivot key
+    // of right, we and right are write locked by lock_path(). The caller
+    // retires right if it returns true.
+    bool merge_child(const Slice& key, Node* right);
+
 private:
     // when the leaf node's number of pivot is out of limit,
     // it then will split the node and push up the split operation.
@@ -89,17 +173,48 @@ private:
 
     void add_pivot(nid_t child, MsgTable* table, Slice key);
 
-    // maybe push down or split the table
-    void maybe_push_down_or_split();
+    // An empty table of the kind our pivots have.
+    MsgTable* new_table();
+
+    // The table of the pivot, NULL if it isn't read yet.
+    MsgTable* pivot_table(size_t index);
+
+    // Read the tables of the pivots which are still missing them.
+    bool load_partitions(const std::vector<size_t>& indexes);
+    MsgTable* decode_table(const char* frame, const Partition& part);
+
+    // maybe push down or split the table, the children to push down to
+    // are read first with our latch released unless they are prefetched
+    void maybe_push_down_or_split(bool prefetched = false);
+
+    // Read the children of the pivots and the tables they lack, 
+    // with no latch held.
+    void prefetch_children(const std::vector<nid_t>& nids);
 
     // internal node would push down the table when it is full 
     void push_down(MsgTable* table, Node* parent);
 
+    // push down to the children of the full pivots at once, which are
+    // prefetched, then each cascades on a thread of the tree's pool.
+    // We are unlocked, returns false if some child couldn't be read.
+    bool push_down_children(const std::vector<size_t>& indexes);
+    void cascade(PushDownBatch* batch);
+
     // only the leaf node would split table when it is full
     void split_table(MsgTable* table);
 
     void insert_msg(size_t index, const Msg& msg);
 
+    // How much we hold for merging: messages of a leaf, children of an
+    // interior node. Siblings are merged if one is underfull and the
+    // sum is within the limit.
+    size_t merge_weight();
+    size_t merge_limit();
+    bool underfull();
+
+    // Merge the adjacent tables of a leaf which are small enough together.
+    void merge_tables();
+
     typedef std::vector<Pivot> Container;
 
     void push_down_locked(MsgTable* table, Node* parent);
@@ -111,16 +226,19 @@ private:
     BufferTree* tree_;
     nid_t self_nid_;
     bool is_leaf_;
+    uint32_t height_;
     size_t refcnt_;
 
     Container pivots_; 
     Mutex pivots_mutex_;
+    size_t unloaded_;       // pivots without table
 
     RWLock rwlock_;
 
     Mutex mutex_;
     bool dirty_;
     bool flushing_;
+    uint64_t version_;
     Timestamp first_write_timestamp_;
     Timestamp last_used_timestamp_;
 };
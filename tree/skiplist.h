@@ -18,15 +18,22 @@ template<class Key, class Comparator>
 class SkipList : boost::noncopyable {
 private:
     struct Node;
+    enum { kMaxHeight = 17 };
 public:
     explicit SkipList(Comparator cmp);
     
     void insert(const Key& key);
     bool contains(const Key& key) const;
     void erase(const Key& key);
-    void resize(size_t size);
     void clear();
 
+    // Keep the first size keys, the links are cut at the first key
+    // dropped. The nodes dropped stay in the arena until clear().
+    void resize(size_t size);
+
+    // Move the keys from the size-th on to the empty list, in linear time.
+    void split(size_t size, SkipList* list);
+
     size_t count() const { return count_; }
     size_t memory_usage() const { return arena_.usage(); }
 
@@ -44,14 +51,50 @@ public:
         void seek_to_middle();
         void seek_to_last();
 
+        // Replace the key with an equal one, the order must not change.
+        void set_key(const Key& key);
+
     private:
         const SkipList* list_;
         Node* node_;
     };
 
+    // Builds the list from sorted input, every key appended must be
+    // greater than the keys in the list. No search is needed, so it
+    // takes linear time.
+    class Appender {
+    public:
+        explicit Appender(SkipList* list);
+
+        void append(const Key& key);
+
+    private:
+        SkipList* list_;
+        Node* last_[kMaxHeight];
+    };
+
+    // Inserts keys in ascending order, every search starts from where
+    // the last one ended, so a sorted run is merged in a single pass.
+    class Merger {
+    public:
+        explicit Merger(SkipList* list);
+
+        // Returns true if an equal key was replaced, it is stored in old.
+        bool insert(const Key& key, Key& old);
+
+        // Returns true if an equal key was removed, it is stored in old.
+        bool erase(const Key& key, Key& old);
+
+    private:
+        // Find the last node less than key on every level, 
+        // returns the node after it on the bottom level.
+        Node* seek(const Key& key);
+
+        SkipList* list_;
+        Node* prev_[kMaxHeight];
+    };
+
 private:
-    enum { kMaxHeight = 17 };
-    
     Arena arena_;
     Node* head_;
     size_t max_height_;
@@ -178,6 +221,134 @@ inline void SkipList<Key, Comparator>::Iterator::seek_to_last()
         node_ = NULL; 
 }
 
+template<class Key, class Comparator>
+inline void SkipList<Key, Comparator>::Iterator::set_key(const Key& key)
+{
+    assert(valid());
+    assert(list_->equal(node_->key, key));
+    node_->set_key(key);
+}
+
+template<class Key, class Comparator>
+SkipList<Key, Comparator>::Appender::Appender(SkipList* list)
+    : list_(list)
+{
+    Node* curr = list_->head_;
+
+    // the last node of every level
+    for (int level = kMaxHeight - 1; level >= 0; level--) {
+        while (curr->next(level) != NULL)
+            curr = curr->next(level);
+        last_[level] = curr;
+    }
+}
+
+template<class Key, class Comparator>
+void SkipList<Key, Comparator>::Appender::append(const Key& key)
+{
+    assert(last_[0] == list_->head_ || list_->compare_(last_[0]->key, key) < 0);
+
+    size_t height = list_->random_height();
+    Node* curr = list_->new_node(key, height);
+
+    for (size_t i = 0; i < height; i++) {
+        curr->set_next(i, NULL);
+        last_[i]->set_next(i, curr);
+        last_[i] = curr;
+    }
+
+    if (height > list_->max_height_)
+        list_->max_height_ = height;
+
+    list_->count_++;
+}
+
+template<class Key, class Comparator>
+SkipList<Key, Comparator>::Merger::Merger(SkipList* list)
+    : list_(list)
+{
+    for (int i = 0; i < kMaxHeight; i++)
+        prev_[i] = list_->head_;
+}
+
+template<class Key, class Comparator>
+typename SkipList<Key, Comparator>::Node*
+SkipList<Key, Comparator>::Merger::seek(const Key& key)
+{
+    Node* head = list_->head_;
+    Node* curr = head;
+
+    for (int level = list_->max_height_ - 1; level >= 0; level--) {
+        // start from the furthest of the last search and the upper level
+        Node* start = prev_[level];
+        if (start == head || 
+            (curr != head && list_->compare_(start->key, curr->key) < 0))
+            start = curr;
+
+        curr = start;
+        Node* next = curr->next(level);
+
+        while (next != NULL && list_->compare_(next->key, key) < 0) {
+            curr = next;
+            next = curr->next(level);
+        }
+        prev_[level] = curr;
+    }
+
+    return prev_[0]->next(0);
+}
+
+template<class Key, class Comparator>
+bool SkipList<Key, Comparator>::Merger::insert(const Key& key, Key& old)
+{
+    Node* head = list_->head_;
+    Node* next = seek(key);
+
+    if (next && list_->equal(next->key, key)) {
+        old = next->key;
+        next->set_key(key);
+        return true;
+    }
+
+    Node* curr;
+    size_t height = list_->random_height();
+
+    if (height > list_->max_height_) {
+        for (size_t i = list_->max_height_; i < height; i++)
+            prev_[i] = head;
+
+        list_->max_height_ = height;
+    }
+
+    curr = list_->new_node(key, height);
+
+    for (size_t i = 0; i < height; i++) {
+        curr->set_next(i, prev_[i]->next(i));
+        prev_[i]->set_next(i, curr);
+    }
+
+    list_->count_++;
+    return false;
+}
+
+template<class Key, class Comparator>
+bool SkipList<Key, Comparator>::Merger::erase(const Key& key, Key& old)
+{
+    Node* next = seek(key);
+
+    if (next == NULL || !list_->equal(next->key, key))
+        return false;
+
+    for (size_t i = 0; i < list_->max_height_; i++) {
+        if (prev_[i]->next(i) == next)
+            prev_[i]->set_next(i, next->next(i));
+    }
+
+    old = next->key;
+    list_->count_--;
+    return true;
+}
+
 template<class Key, class Comparator>
 bool SkipList<Key, Comparator>::equal(const Key& a, const Key& b) const
 {
@@ -314,27 +485,57 @@ template<class Key, class Comparator>
 void SkipList<Key, Comparator>::resize(size_t size)
 {
     assert(size <= count_);
-    
-    std::vector<Key> keys;
-    keys.reserve(size);
+
+    if (size == count_)
+        return;
+
+    if (size == 0) {
+        clear();
+        return;
+    }
 
     Iterator iter(this);
     iter.seek_to_first();
 
-    for (size_t i = 0; i < size; i++) {
-        assert(iter.valid());
-        keys.push_back(iter.key());
+    for (size_t i = 0; i < size; i++)
         iter.next();
-    }
 
-    clear();
+    assert(iter.valid());
+
+    // The keys are unique, every level is cut before the first key dropped.
+    Node* prev[kMaxHeight];
+    find_greater_or_equal(iter.key(), prev);
+
+    for (size_t i = 0; i < max_height_; i++)
+        prev[i]->set_next(i, NULL);
 
-    for (size_t i = 0; i < keys.size(); i++) 
-        insert(keys[i]);
+    while (max_height_ > 1 && head_->next(max_height_ - 1) == NULL)
+        max_height_--;
 
     count_ = size;
 }
 
+template<class Key, class Comparator>
+void SkipList<Key, Comparator>::split(size_t size, SkipList* list)
+{
+    assert(size <= count_);
+    assert(list->count() == 0);
+
+    Iterator iter(this);
+    iter.seek_to_first();
+
+    for (size_t i = 0; i < size; i++)
+        iter.next();
+
+    Appender appender(list);
+    while (iter.valid()) {
+        appender.append(iter.key());
+        iter.next();
+    }
+
+    resize(size);
+}
+
 template<class Key, class Comparator>
 void SkipList<Key, Comparator>::clear()
 {
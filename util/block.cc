@@ -36,7 +36,19 @@ BlockReader& BlockReader::operator>>(uint64_t& v)
 
 BlockReader& BlockReader::operator>>(Slice& s)
 {
-    if (!succ_) return *this;
+    read_slice(s, true);
+    return *this;
+}
+
+BlockReader& BlockReader::read_ref(Slice& s)
+{
+    read_slice(s, false);
+    return *this;
+}
+
+void BlockReader::read_slice(Slice& s, bool copy)
+{
+    if (!succ_) return;
 
     uint32_t size;
     succ_ = read_uint(size);
@@ -44,13 +56,13 @@ BlockReader& BlockReader::operator>>(Slice& s)
     if (succ_) {
         assert(offset_ <= block_.size());
         if (offset_ + size <= block_.size()) {
-            s = Slice(block_.data() + offset_, size).clone();
+            s = Slice(block_.data() + offset_, size);
+            if (copy) s = s.clone();
             offset_ += size;
         } else {
             succ_ = false;
         }
     }
-    return *this;
 }
 
 template<typename T>
@@ -98,10 +98,16 @@ public:
     self& operator>>(uint64_t& v);
     self& operator>>(Slice& s);
 
+    // Like operator>>(Slice&), but the slice points into the block
+    // instead of owning a copy.
+    self& read_ref(Slice& s);
+
 private:
     template<typename T>
     bool read_uint(T& v);
 
+    void read_slice(Slice& s, bool copy);
+
     Block& block_;
     size_t offset_;
     bool succ_;
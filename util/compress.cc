@@ -0,0 +1,263 @@
+#include "util/compress.h"
+
+#include <string.h>
+
+using namespace yodb;
+
+namespace {
+
+const size_t kMinMatch     = 4;
+const size_t kLastLiterals = 5;   // the last bytes are always literals
+const size_t kMFLimit      = 12;  // no match starts in the last bytes
+const size_t kMaxOffset    = 65535;
+const int    kHashLog      = 12;
+
+// Blocks smaller than this are not worth compressing.
+const size_t kMinCompressSize = 64;
+
+inline uint32_t load32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t hash32(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - kHashLog);
+}
+
+inline uint8_t* write_length(uint8_t* op, size_t len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+inline bool read_length(const uint8_t*& ip, const uint8_t* iend, size_t& len)
+{
+    uint8_t b;
+
+    do {
+        if (ip >= iend) return false;
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+
+    return true;
+}
+
+} // namespace
+
+size_t yodb::lz4_compress(const char* source, size_t n, char* dest, size_t cap)
+{
+    const uint8_t* src = (const uint8_t*)source;
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* end = src + n;
+
+    uint8_t* dst = (uint8_t*)dest;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + cap;
+
+    if (n > kMFLimit) {
+        uint32_t table[1 << kHashLog];
+        memset(table, 0, sizeof(table));
+
+        const uint8_t* mflimit = end - kMFLimit;
+        const uint8_t* mlimit = end - kLastLiterals;
+
+        while (ip < mflimit) {
+            uint32_t seq = load32(ip);
+            uint32_t h = hash32(seq);
+            const uint8_t* ref = src + table[h];
+
+            table[h] = ip - src;
+
+            if (ref >= ip || (size_t)(ip - ref) > kMaxOffset || load32(ref) != seq) {
+                // skip faster over the data which doesn't compress
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+
+            const uint8_t* mp = ip + kMinMatch;
+            const uint8_t* rp = ref + kMinMatch;
+            while (mp < mlimit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            size_t lit = ip - anchor;
+            size_t mlen = mp - ip - kMinMatch;
+
+            if (op + 1 + lit + lit / 255 + 1 + 2 + mlen / 255 + 1 > oend)
+                return 0;
+
+            uint8_t* token = op++;
+
+            *token = (lit >= 15 ? 15 : lit) << 4;
+            if (lit >= 15) op = write_length(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+
+            size_t offset = ip - ref;
+            *op++ = offset & 0xff;
+            *op++ = offset >> 8;
+
+            *token |= (mlen >= 15 ? 15 : mlen);
+            if (mlen >= 15) op = write_length(op, mlen - 15);
+
+            ip = mp;
+            anchor = ip;
+        }
+    }
+
+    size_t lit = end - anchor;
+
+    if (op + 1 + lit + lit / 255 + 1 > oend)
+        return 0;
+
+    uint8_t* token = op++;
+
+    *token = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15) op = write_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    return op - dst;
+}
+
+bool yodb::lz4_uncompress(const char* source, size_t n, char* dest, size_t raw)
+{
+    const uint8_t* ip = (const uint8_t*)source;
+    const uint8_t* iend = ip + n;
+
+    uint8_t* dst = (uint8_t*)dest;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + raw;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        size_t lit = token >> 4;
+        if (lit == 15 && !read_length(ip, iend, lit))
+            return false;
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+            return false;
+
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+
+        // the last sequence has only literals
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return false;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        if (offset == 0 || offset > (size_t)(op - dst))
+            return false;
+
+        size_t mlen = token & 15;
+        if (mlen == 15 && !read_length(ip, iend, mlen))
+            return false;
+        mlen += kMinMatch;
+
+        if (mlen > (size_t)(oend - op))
+            return false;
+
+        const uint8_t* match = op - offset;
+
+        if (offset >= mlen) {
+            memcpy(op, match, mlen);
+            op += mlen;
+        } else {
+            // overlapped copy repeats the pattern
+            while (mlen--) *op++ = *match++;
+        }
+    }
+
+    return op == oend;
+}
+
+size_t yodb::max_compressed_size(size_t n)
+{
+    return kCompressHeaderSize + n;
+}
+
+size_t yodb::compress(CompressType type, const char* src, size_t n, char* dst)
+{
+    size_t size = 0;
+
+    // It must save at least 1/8 of the space, or we keep it raw.
+    if (type == kLZ4Compress && n >= kMinCompressSize)
+        size = lz4_compress(src, n, dst + kCompressHeaderSize, n - n / 8);
+
+    if (size == 0) {
+        type = kNoCompress;
+        size = n;
+
+        if (src != dst + kCompressHeaderSize)
+            memmove(dst + kCompressHeaderSize, src, n);
+    }
+
+    uint32_t raw = n;
+
+    dst[0] = type;
+    memcpy(dst + 1, &raw, sizeof(raw));
+
+    return kCompressHeaderSize + size;
+}
+
+bool yodb::compress_header(const char* src, size_t n, CompressType& type, size_t& raw)
+{
+    if (n < kCompressHeaderSize)
+        return false;
+
+    uint32_t size;
+    memcpy(&size, src + 1, sizeof(size));
+
+    switch (src[0]) {
+    case kNoCompress:
+        if (size > n - kCompressHeaderSize)
+            return false;
+        type = kNoCompress;
+        break;
+    case kLZ4Compress:
+        type = kLZ4Compress;
+        break;
+    default:
+        return false;
+    }
+
+    raw = size;
+    return raw != 0;
+}
+
+bool yodb::uncompress(const char* src, size_t n, char* dst)
+{
+    CompressType type;
+    size_t raw;
+
+    if (!compress_header(src, n, type, raw))
+        return false;
+
+    src += kCompressHeaderSize;
+    n -= kCompressHeaderSize;
+
+    if (type == kNoCompress) {
+        memcpy(dst, src, raw);
+        return true;
+    }
+
+    return lz4_uncompress(src, n, dst, raw);
+}
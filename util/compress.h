@@ -0,0 +1,39 @@
+#ifndef _YODB_COMPRESS_H_
+#define _YODB_COMPRESS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace yodb {
+
+enum CompressType {
+    kNoCompress  = 0,
+    kLZ4Compress = 1,
+};
+
+// Every compressed block is framed as [type: 1 byte][raw size: 4 bytes],
+// followed by the payload, which is the raw data for kNoCompress.
+const size_t kCompressHeaderSize = 5;
+
+// Upper bound of the framed size of n raw bytes.
+size_t max_compressed_size(size_t n);
+
+// Frame n raw bytes of src into dst, which must have max_compressed_size(n)
+// bytes room. Data which doesn't compress well is stored raw, src may also
+// be dst + kCompressHeaderSize in that case. Returns the framed size.
+size_t compress(CompressType type, const char* src, size_t n, char* dst);
+
+// Type and raw size of the framed block, false if the header is corrupted.
+bool compress_header(const char* src, size_t n, CompressType& type, size_t& raw);
+
+// Unframe the block into dst, which must have raw size bytes room.
+bool uncompress(const char* src, size_t n, char* dst);
+
+// The LZ4 block format, returns the compressed size, or zero
+// if the result doesn't fit in cap bytes.
+size_t lz4_compress(const char* src, size_t n, char* dst, size_t cap);
+bool lz4_uncompress(const char* src, size_t n, char* dst, size_t raw);
+
+} // namespace yodb
+
+#endif // _YODB_COMPRESS_H_
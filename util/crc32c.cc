@@ -0,0 +1,122 @@
+#include "util/crc32c.h"
+
+#include <string.h>
+
+using namespace yodb;
+
+namespace {
+
+// Castagnoli polynomial, reversed.
+const uint32_t kPoly = 0x82f63b78;
+
+struct Table {
+    Table()
+    {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int k = 0; k < 8; k++)
+                crc = (crc >> 1) ^ (kPoly & (0 - (crc & 1)));
+            t[0][i] = crc;
+        }
+
+        for (uint32_t i = 0; i < 256; i++) {
+            for (int k = 1; k < 4; k++)
+                t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+        }
+    }
+
+    uint32_t t[4][256];
+};
+
+const Table table;
+
+// Slicing by 4 bytes, used when the instruction is not available.
+uint32_t extend_software(uint32_t crc, const uint8_t* p, size_t n)
+{
+    while (n && ((uintptr_t)p & 3)) {
+        crc = (crc >> 8) ^ table.t[0][(crc ^ *p++) & 0xff];
+        n--;
+    }
+
+    while (n >= 4) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        crc ^= v;
+        crc = table.t[3][crc & 0xff] ^
+              table.t[2][(crc >> 8) & 0xff] ^
+              table.t[1][(crc >> 16) & 0xff] ^
+              table.t[0][crc >> 24];
+        p += 4;
+        n -= 4;
+    }
+
+    while (n--)
+        crc = (crc >> 8) ^ table.t[0][(crc ^ *p++) & 0xff];
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+uint32_t extend_hardware(uint32_t crc, const uint8_t* p, size_t n)
+{
+    uint64_t crc64 = crc;
+
+    while (n && ((uintptr_t)p & 7)) {
+        crc64 = __builtin_ia32_crc32qi(crc64, *p++);
+        n--;
+    }
+
+    while (n >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc64 = __builtin_ia32_crc32di(crc64, v);
+        p += 8;
+        n -= 8;
+    }
+
+    while (n--)
+        crc64 = __builtin_ia32_crc32qi(crc64, *p++);
+
+    return crc64;
+}
+
+bool has_sse42()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+
+const bool kAccelerated = has_sse42();
+
+#else
+
+uint32_t extend_hardware(uint32_t crc, const uint8_t* p, size_t n)
+{
+    return extend_software(crc, p, n);
+}
+
+const bool kAccelerated = false;
+
+#endif
+
+} // namespace
+
+uint32_t crc32c::extend(uint32_t init_crc, const char* data, size_t n)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    uint32_t crc = init_crc ^ 0xffffffffu;
+
+    if (kAccelerated)
+        crc = extend_hardware(crc, p, n);
+    else
+        crc = extend_software(crc, p, n);
+
+    return crc ^ 0xffffffffu;
+}
+
+bool crc32c::accelerated()
+{
+    return kAccelerated;
+}
@@ -0,0 +1,26 @@
+#ifndef _YODB_CRC32C_H_
+#define _YODB_CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace yodb {
+namespace crc32c {
+
+// Returns the crc32c of concat(A, data[0, n-1]) where init_crc
+// is the crc32c of some string A.
+uint32_t extend(uint32_t init_crc, const char* data, size_t n);
+
+// Returns the crc32c of data[0, n-1].
+inline uint32_t value(const char* data, size_t n)
+{
+    return extend(0, data, n);
+}
+
+// Whether the SSE4.2 crc32 instruction is used.
+bool accelerated();
+
+} // namespace crc32c
+} // namespace yodb
+
+#endif // _YODB_CRC32C_H_